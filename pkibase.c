@@ -11,7 +11,12 @@
 #endif /* PKIM_H */
 
 #include "pki3hack.h"
+#include "ckhelper.h"
 #include "plhash.h"
+#include "sechash.h"
+#include "nssrwlk.h"
+#include "prsystem.h"
+#include <time.h>
 
 extern const NSSError NSS_ERROR_NOT_FOUND;
 
@@ -42,28 +47,155 @@ compare_instances(const void *v1, const void *v2)
   return (one->token == two->token && one->handle == two->handle);  
 }
 
-/* hash function for the object hash table */
+/* hash function for the object hash table
+ *
+ * Hash the contents of the uid items, not just their lengths; certificates
+ * of the same size would otherwise all land in one bucket.  PLHashTable
+ * keeps the result in each entry's keyHash, so the uid bytes are only
+ * walked once per insert or lookup and never again on rehash.
+ */
 static PLHashNumber
 hash_object(const void  *arg)
 {
   const NSSItem *uid=arg;
-  PLHashNumber hashvalue = uid[0].size;
+  PLHashNumber hashvalue = 2166136261U; /* FNV-1a offset basis */
   int i;
-  for (i=1;i<MAX_ITEMS_FOR_UID;i++) {
-    /* hash function can be improved */
-    hashvalue =  hashvalue ^ uid[i].size;
+  PRUint32 j;
+  for (i=0;i<MAX_ITEMS_FOR_UID;i++) {
+    const unsigned char *data = uid[i].data;
+    for (j=0;j<uid[i].size;j++) {
+      hashvalue = (hashvalue ^ data[j]) * 16777619U;
+    }
+    /* separate the items so { "ab", "" } and { "a", "b" } differ */
+    hashvalue = (hashvalue ^ uid[i].size) * 16777619U;
   }
   return hashvalue; 
 }
 
-/* hash function for the instance hash table */
+/* hash function for the instance hash table
+ *
+ * Token pointers have their low bits fixed by allocator alignment and
+ * softoken hands out small sequential handles, so a plain XOR of the two
+ * leaves most buckets empty.  Pack both into 64 bits and run them through
+ * the murmur3 finalizer so every input bit affects the bucket index.
+ */
 static PLHashNumber
 hash_instance(const void  *arg)
 {
   const nssCryptokiObject *key = arg;
-  /* hash function can be improved */
-  PLHashNumber hashvalue =  (PLHashNumber)((unsigned long)key->token) ^ (PLHashNumber)((unsigned long)key->handle);
-  return hashvalue;
+  PRUint64 h = (PRUint64)(PRUptrdiff)key->token;
+  h ^= (PRUint64)key->handle * 0x9e3779b97f4a7c15ULL;
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return (PLHashNumber)(h ^ (h >> 32));
+}
+
+/* Striped locks
+ *
+ * Objects created with nssPKIStripedLock do not get a lock of their own.
+ * Instead the object address selects one of a pool of monitors, sized
+ * from the processor count.  This saves a monitor allocation per object;
+ * the cost is that unrelated objects occasionally share a lock.  Monitors
+ * are used so that nested locking of two objects on the same stripe does
+ * not self-deadlock.
+ *
+ * The pool is created by the first striped object and destroyed with the
+ * last one, so it does not outlive the objects at shutdown.
+ * pkiLockStripeUsers counts the striped objects, and pkiLockStripesBusy
+ * is a flag guarding the pool while it is created, looked up or torn
+ * down.
+ */
+#define PKI_MIN_LOCK_STRIPES 16
+#define PKI_MAX_LOCK_STRIPES 1024
+
+static PZMonitor **pkiLockStripes = NULL;
+static PRUint32 pkiLockStripeMask = 0;
+static PRUint32 pkiLockStripeUsers = 0;
+static PRInt32 pkiLockStripesBusy = 0;
+
+static void
+pki_LockStripePool(void)
+{
+    while (PR_ATOMIC_SET(&pkiLockStripesBusy, 1) != 0) {
+	PR_Sleep(PR_INTERVAL_NO_WAIT);
+    }
+}
+
+static void
+pki_UnlockStripePool(void)
+{
+    (void)PR_ATOMIC_SET(&pkiLockStripesBusy, 0);
+}
+
+/* Destroy the first count monitors and the pool.  Caller holds the pool
+ * flag.
+ */
+static void
+pki_DestroyLockStripes(PRUint32 count)
+{
+    PRUint32 i;
+    for (i=0; i<count; i++) {
+	PZ_DestroyMonitor(pkiLockStripes[i]);
+    }
+    nss_ZFreeIf(pkiLockStripes);
+    pkiLockStripes = NULL;
+    pkiLockStripeMask = 0;
+}
+
+/* caller holds the pool flag */
+static PRStatus
+pki_InitLockStripes(void)
+{
+    PRInt32 cpus = PR_GetNumberOfProcessors();
+    PRUint32 count = PKI_MIN_LOCK_STRIPES;
+    PRUint32 i;
+    while (count < PKI_MAX_LOCK_STRIPES && cpus > 0 && 
+           count < (PRUint32)cpus * 4) {
+	count <<= 1;
+    }
+    pkiLockStripes = nss_ZNEWARRAY(NULL, PZMonitor *, count);
+    if (!pkiLockStripes) {
+	return PR_FAILURE;
+    }
+    for (i=0; i<count; i++) {
+	pkiLockStripes[i] = PZ_NewMonitor(nssILockSSL);
+	if (!pkiLockStripes[i]) {
+	    /* leave no partial pool; the next caller tries again */
+	    pki_DestroyLockStripes(i);
+	    return PR_FAILURE;
+	}
+    }
+    pkiLockStripeMask = count - 1;
+    return PR_SUCCESS;
+}
+
+static PZMonitor *
+pki_GetLockStripe(nssPKIObject *object)
+{
+    PZMonitor *stripe = NULL;
+    PRUint64 h = (PRUint64)(PRUptrdiff)object;
+    h = (h >> 4) * 0x9e3779b97f4a7c15ULL;
+    pki_LockStripePool();
+    if (pkiLockStripes || pki_InitLockStripes() == PR_SUCCESS) {
+	stripe = pkiLockStripes[(PRUint32)(h >> 32) & pkiLockStripeMask];
+	pkiLockStripeUsers++;
+    }
+    pki_UnlockStripePool();
+    return stripe;
+}
+
+static void
+pki_ReleaseLockStripe(void)
+{
+    pki_LockStripePool();
+    PORT_Assert(pkiLockStripeUsers > 0);
+    if (pkiLockStripeUsers > 0 && --pkiLockStripeUsers == 0) {
+	pki_DestroyLockStripes(pkiLockStripeMask + 1);
+    }
+    pki_UnlockStripePool();
 }
 
 NSS_IMPLEMENT void
@@ -71,11 +203,15 @@ nssPKIObject_Lock(nssPKIObject * object)
 {
     switch (object->lockType) {
     case nssPKIMonitor:
+    case nssPKIStripedLock:
         PZ_EnterMonitor(object->sync.mlock);
         break;
     case nssPKILock:
         PZ_Lock(object->sync.lock);
         break;
+    case nssPKIRWLock:
+        NSSRWLock_LockWrite(object->sync.rwlock);
+        break;
     default:
         PORT_Assert(0);
     }
@@ -86,16 +222,44 @@ nssPKIObject_Unlock(nssPKIObject * object)
 {
     switch (object->lockType) {
     case nssPKIMonitor:
+    case nssPKIStripedLock:
         PZ_ExitMonitor(object->sync.mlock);
         break;
     case nssPKILock:
         PZ_Unlock(object->sync.lock);
         break;
+    case nssPKIRWLock:
+        NSSRWLock_UnlockWrite(object->sync.rwlock);
+        break;
     default:
         PORT_Assert(0);
     }
 }
 
+/* Shared (read) lock, for accessors that do not modify the instance
+ * array.  Only nssPKIRWLock objects actually share; the other lock
+ * types fall back to the exclusive lock.
+ */
+NSS_IMPLEMENT void
+nssPKIObject_LockShared(nssPKIObject * object)
+{
+    if (object->lockType == nssPKIRWLock) {
+        NSSRWLock_LockRead(object->sync.rwlock);
+    } else {
+        nssPKIObject_Lock(object);
+    }
+}
+
+NSS_IMPLEMENT void
+nssPKIObject_UnlockShared(nssPKIObject * object)
+{
+    if (object->lockType == nssPKIRWLock) {
+        NSSRWLock_UnlockRead(object->sync.rwlock);
+    } else {
+        nssPKIObject_Unlock(object);
+    }
+}
+
 NSS_IMPLEMENT PRStatus
 nssPKIObject_NewLock(nssPKIObject * object, nssPKILockType lockType)
 {
@@ -107,6 +271,12 @@ nssPKIObject_NewLock(nssPKIObject * object, nssPKILockType lockType)
     case nssPKILock:
         object->sync.lock = PZ_NewLock(nssILockSSL);
         return (object->sync.lock ? PR_SUCCESS : PR_FAILURE);
+    case nssPKIRWLock:
+        object->sync.rwlock = NSSRWLock_New(NSS_RWLOCK_RANK_NONE, NULL);
+        return (object->sync.rwlock ? PR_SUCCESS : PR_FAILURE);
+    case nssPKIStripedLock:
+        object->sync.mlock = pki_GetLockStripe(object);
+        return (object->sync.mlock ? PR_SUCCESS : PR_FAILURE);
     default:
         PORT_Assert(0);
         return PR_FAILURE;
@@ -125,6 +295,15 @@ nssPKIObject_DestroyLock(nssPKIObject * object)
         PZ_DestroyLock(object->sync.lock);
         object->sync.lock = NULL;
         break;
+    case nssPKIRWLock:
+        NSSRWLock_Destroy(object->sync.rwlock);
+        object->sync.rwlock = NULL;
+        break;
+    case nssPKIStripedLock:
+        /* the stripe is shared; the pool goes with the last user */
+        object->sync.mlock = NULL;
+        pki_ReleaseLockStripe();
+        break;
     default:
         PORT_Assert(0);
     }
@@ -144,6 +323,7 @@ nssPKIObject_Create (
     NSSArena *arena;
     nssArenaMark *mark = NULL;
     nssPKIObject *object;
+    PRBool haveLock = PR_FALSE;
     if (arenaOpt) {
 	arena = arenaOpt;
 	mark = nssArena_Mark(arena);
@@ -163,6 +343,7 @@ nssPKIObject_Create (
     if (PR_SUCCESS != nssPKIObject_NewLock(object, lockType)) {
 	goto loser;
     }
+    haveLock = PR_TRUE;
     if (instanceOpt) {
 	if (nssPKIObject_AddInstance(object, instanceOpt) != PR_SUCCESS) {
 	    goto loser;
@@ -174,6 +355,10 @@ nssPKIObject_Create (
     }
     return object;
 loser:
+    if (haveLock) {
+	/* a striped lock holds the stripe pool open; see pki_GetLockStripe */
+	nssPKIObject_DestroyLock(object);
+    }
     if (mark) {
 	nssArena_Release(arena, mark);
     } else {
@@ -209,69 +394,258 @@ nssPKIObject_AddRef (
     return object;
 }
 
-NSS_IMPLEMENT PRStatus
-nssPKIObject_AddInstance (
-  nssPKIObject *object,
-  nssCryptokiObject *instance
-)
+/* The instances array grows geometrically: it doubles when it is full
+ * and is halved once removals leave it no more than a quarter full, so a
+ * run of adds or removals costs O(log n) reallocations.  Its size is
+ * kept in object->instancesCapacity.
+ *
+ * The capacity only means something while numInstances is nonzero.
+ * Code outside this file (DeleteCertTrustMatchingSlot in pki3hack.c)
+ * frees the array and zeroes numInstances itself, without clearing the
+ * pointer or the capacity, so an empty object always gets a new array
+ * and the old pointer is never touched.  Callers hold the object lock.
+ */
+#define PKI_INSTANCES_MIN_CAPACITY 2
+
+static PRStatus
+instances_grow(nssPKIObject *object)
 {
-    nssCryptokiObject **newInstances = NULL;
+    nssCryptokiObject **newInstances;
+    PRUint32 newCapacity;
+    if (object->numInstances == 0) {
+	newCapacity = PKI_INSTANCES_MIN_CAPACITY;
+	newInstances = nss_ZNEWARRAY(object->arena, nssCryptokiObject *,
+	                             newCapacity);
+    } else if (object->numInstances < object->instancesCapacity) {
+	return PR_SUCCESS;
+    } else {
+	newCapacity = object->numInstances * 2;
+	newInstances = nss_ZREALLOCARRAY(object->instances, 
+	                                 nssCryptokiObject *, newCapacity);
+    }
+    if (!newInstances) {
+	return PR_FAILURE;
+    }
+    object->instances = newInstances;
+    object->instancesCapacity = newCapacity;
+    return PR_SUCCESS;
+}
 
-    nssPKIObject_Lock(object);
+static void
+instances_shrink(nssPKIObject *object)
+{
+    nssCryptokiObject **newInstances;
     if (object->numInstances == 0) {
-	newInstances = nss_ZNEWARRAY(object->arena,
-				     nssCryptokiObject *,
-				     object->numInstances + 1);
+	nss_ZFreeIf(object->instances);
+	object->instances = NULL;
+	object->instancesCapacity = 0;
+	return;
+    }
+    if (object->instancesCapacity <= PKI_INSTANCES_MIN_CAPACITY ||
+        object->numInstances > object->instancesCapacity / 4) {
+	return;
+    }
+    newInstances = nss_ZREALLOCARRAY(object->instances, nssCryptokiObject *,
+                                     object->instancesCapacity / 2);
+    if (newInstances) { /* otherwise keep the larger array */
+	object->instances = newInstances;
+	object->instancesCapacity /= 2;
+    }
+}
+
+/* The token index
+ *
+ * Token removal calls nssPKIObject_RemoveInstanceForToken for every
+ * cached object.  An object with more than PKI_TOKEN_INDEX_MIN_INSTANCES
+ * instances keeps a small open addressed table in the object arena that
+ * maps each token to the slot of an instance on it, so that lookup does
+ * not scan the array.  Entries hold the slot plus one, 0 marking an
+ * empty entry, and the table is kept at most half full.
+ *
+ * object->tokenIndexCount is the numInstances the index was built for.
+ * Code outside this file compacts the array and lowers numInstances
+ * without updating the index, so an index whose count does not match is
+ * stale: lookups scan the array instead, and the next change made here
+ * rebuilds it.  Removals here move another instance into the freed slot,
+ * so they rebuild it too.  Callers hold the object lock, and only holders
+ * of the exclusive lock change the index.
+ */
+#define PKI_TOKEN_INDEX_MIN_INSTANCES 4
+#define PKI_TOKEN_INDEX_MIN_SIZE 8
+#define PKI_TOKEN_INDEX_MAX_INSTANCES 0xffff
+
+/* Returns the entry holding token, or the empty entry where it would go */
+static PRUint32
+token_index_probe(nssPKIObject *object, NSSToken *token)
+{
+    PRUint64 h = ((PRUint64)(PRUptrdiff)token >> 4) * 0x9e3779b97f4a7c15ULL;
+    PRUint32 e = (PRUint32)(h >> 32) & object->tokenIndexMask;
+    while (object->tokenIndex[e] != 0 &&
+           object->instances[object->tokenIndex[e] - 1]->token != token) {
+	e = (e + 1) & object->tokenIndexMask;
+    }
+    return e;
+}
+
+static PRBool
+token_index_is_valid(nssPKIObject *object)
+{
+    return (object->tokenIndex && 
+            object->tokenIndexCount == object->numInstances);
+}
+
+static void
+token_index_drop(nssPKIObject *object)
+{
+    nss_ZFreeIf(object->tokenIndex);
+    object->tokenIndex = NULL;
+    object->tokenIndexMask = 0;
+    object->tokenIndexCount = 0;
+}
+
+/* Build the index over the current instances, or drop it if the object
+ * does not need one.  If the table cannot be allocated there is no
+ * index, and lookups scan the array.
+ */
+static void
+token_index_rebuild(nssPKIObject *object)
+{
+    PRUint32 i, size = PKI_TOKEN_INDEX_MIN_SIZE;
+    if (object->numInstances <= PKI_TOKEN_INDEX_MIN_INSTANCES ||
+        object->numInstances > PKI_TOKEN_INDEX_MAX_INSTANCES) {
+	token_index_drop(object);
+	return;
+    }
+    while (size < object->numInstances * 2) {
+	size <<= 1;
+    }
+    if (object->tokenIndex && size == object->tokenIndexMask + 1) {
+	nsslibc_memset(object->tokenIndex, 0, size * sizeof(PRUint16));
     } else {
-	PRBool found = PR_FALSE;
-	PRUint32 i;
-	for (i=0; i<object->numInstances; i++) {
-	    if (nssCryptokiObject_Equal(object->instances[i], instance)) {
-		found = PR_TRUE;
-		break;
-	    }
+	token_index_drop(object);
+	object->tokenIndex = nss_ZNEWARRAY(object->arena, PRUint16, size);
+	if (!object->tokenIndex) {
+	    return;
 	}
-	if (found) {
-	    /* The new instance is identical to one in the array, except
-	     * perhaps that the label may be different.  So replace 
-	     * the label in the array instance with the label from the 
-	     * new instance, and discard the new instance.
-	     */
-	    nss_ZFreeIf(object->instances[i]->label);
-	    object->instances[i]->label = instance->label;
-	    nssPKIObject_Unlock(object);
-	    instance->label = NULL;
-	    nssCryptokiObject_Destroy(instance);
-	    return PR_SUCCESS;
+	object->tokenIndexMask = size - 1;
+    }
+    object->tokenIndexCount = object->numInstances;
+    for (i=0; i<object->numInstances; i++) {
+	PRUint32 e = token_index_probe(object, object->instances[i]->token);
+	if (object->tokenIndex[e] == 0) {
+	    object->tokenIndex[e] = (PRUint16)(i + 1);
 	}
-	newInstances = nss_ZREALLOCARRAY(object->instances,
-					 nssCryptokiObject *,
-					 object->numInstances + 1);
     }
-    if (newInstances) {
-	object->instances = newInstances;
-	newInstances[object->numInstances++] = instance;
+}
+
+/* Enter the instance just appended to the array */
+static void
+token_index_add(nssPKIObject *object)
+{
+    PRUint32 slot = object->numInstances - 1;
+    PRUint32 e;
+    if (!object->tokenIndex || object->tokenIndexCount != slot ||
+        object->numInstances * 2 > object->tokenIndexMask + 1) {
+	token_index_rebuild(object);
+	return;
     }
-    nssPKIObject_Unlock(object);
-    return (newInstances ? PR_SUCCESS : PR_FAILURE);
+    e = token_index_probe(object, object->instances[slot]->token);
+    if (object->tokenIndex[e] == 0) {
+	object->tokenIndex[e] = (PRUint16)(slot + 1);
+    }
+    object->tokenIndexCount = object->numInstances;
 }
 
-NSS_IMPLEMENT PRBool
-nssPKIObject_HasInstance (
+/* Returns the slot of an instance of object on token, or 
+ * object->numInstances if there is none.
+ */
+static PRUint32
+find_instance_for_token (
+  nssPKIObject *object,
+  NSSToken *token
+)
+{
+    PRUint32 i;
+    if (token_index_is_valid(object)) {
+	i = object->tokenIndex[token_index_probe(object, token)];
+	return (i > 0 && i <= object->numInstances) ? i - 1 
+	                                            : object->numInstances;
+    }
+    for (i=0; i<object->numInstances; i++) {
+	if (object->instances[i]->token == token) {
+	    break;
+	}
+    }
+    return i;
+}
+
+/* Returns the slot of the instance equal to instance, or 
+ * object->numInstances if there is none.
+ */
+static PRUint32
+find_instance (
   nssPKIObject *object,
   nssCryptokiObject *instance
 )
 {
     PRUint32 i;
-    PRBool hasIt = PR_FALSE;;
-    nssPKIObject_Lock(object);
+    if (token_index_is_valid(object) &&
+        find_instance_for_token(object, instance->token) == 
+                                                    object->numInstances) {
+	/* nothing on that token */
+	return object->numInstances;
+    }
     for (i=0; i<object->numInstances; i++) {
 	if (nssCryptokiObject_Equal(object->instances[i], instance)) {
-	    hasIt = PR_TRUE;
 	    break;
 	}
     }
+    return i;
+}
+
+NSS_IMPLEMENT PRStatus
+nssPKIObject_AddInstance (
+  nssPKIObject *object,
+  nssCryptokiObject *instance
+)
+{
+    PRStatus status;
+    PRUint32 i;
+
+    nssPKIObject_Lock(object);
+    i = find_instance(object, instance);
+    if (i < object->numInstances) {
+	/* The new instance is identical to one in the array, except
+	 * perhaps that the label may be different.  So replace 
+	 * the label in the array instance with the label from the 
+	 * new instance, and discard the new instance.
+	 */
+	nss_ZFreeIf(object->instances[i]->label);
+	object->instances[i]->label = instance->label;
+	nssPKIObject_Unlock(object);
+	instance->label = NULL;
+	nssCryptokiObject_Destroy(instance);
+	return PR_SUCCESS;
+    }
+    status = instances_grow(object);
+    if (status == PR_SUCCESS) {
+	object->instances[object->numInstances++] = instance;
+	token_index_add(object);
+    }
     nssPKIObject_Unlock(object);
+    return status;
+}
+
+NSS_IMPLEMENT PRBool
+nssPKIObject_HasInstance (
+  nssPKIObject *object,
+  nssCryptokiObject *instance
+)
+{
+    PRBool hasIt;
+    nssPKIObject_LockShared(object);
+    hasIt = (find_instance(object, instance) < object->numInstances);
+    nssPKIObject_UnlockShared(object);
     return hasIt;
 }
 
@@ -283,29 +657,26 @@ nssPKIObject_RemoveInstanceForToken (
 {
     PRUint32 i;
     nssCryptokiObject *instanceToRemove = NULL;
+    /* When a token goes away this is called for every cached object, and
+     * most of them do not live on that token.  Those are left unmodified,
+     * and for objects with many instances the token index answers
+     * without a scan.
+     */
     nssPKIObject_Lock(object);
-    if (object->numInstances == 0) {
+    if (object->tokenIndex && !token_index_is_valid(object)) {
+	token_index_rebuild(object);
+    }
+    i = find_instance_for_token(object, token);
+    if (i == object->numInstances) {
 	nssPKIObject_Unlock(object);
 	return PR_SUCCESS;
     }
-    for (i=0; i<object->numInstances; i++) {
-	if (object->instances[i]->token == token) {
-	    instanceToRemove = object->instances[i];
-	    object->instances[i] = object->instances[object->numInstances-1];
-	    object->instances[object->numInstances-1] = NULL;
-	    break;
-	}
-    }
-    if (--object->numInstances > 0) {
-	nssCryptokiObject **instances = nss_ZREALLOCARRAY(object->instances,
-	                                      nssCryptokiObject *,
-	                                      object->numInstances);
-	if (instances) {
-	    object->instances = instances;
-	}
-    } else {
-	nss_ZFreeIf(object->instances);
-    }
+    instanceToRemove = object->instances[i];
+    object->instances[i] = object->instances[object->numInstances-1];
+    object->instances[object->numInstances-1] = NULL;
+    object->numInstances--;
+    instances_shrink(object);
+    token_index_rebuild(object);
     nssCryptokiObject_Destroy(instanceToRemove);
     nssPKIObject_Unlock(object);
     return PR_SUCCESS;
@@ -325,6 +696,11 @@ nssPKIObject_DeleteStoredObject (
     PRStatus status = PR_SUCCESS;
     numNotDestroyed = 0;
     nssPKIObject_Lock(object);
+    if (object->numInstances == 0) {
+	/* there may be no array to free; see instances_grow */
+	nssPKIObject_Unlock(object);
+	return PR_SUCCESS;
+    }
     for (i=0; i<object->numInstances; i++) {
 	nssCryptokiObject *instance = object->instances[i];
 	status = nssToken_DeleteStoredObject(instance);
@@ -335,12 +711,9 @@ nssPKIObject_DeleteStoredObject (
 	    object->instances[numNotDestroyed++] = instance;
 	}
     }
-    if (numNotDestroyed == 0) {
-	nss_ZFreeIf(object->instances);
-	object->numInstances = 0;
-    } else {
-	object->numInstances = numNotDestroyed;
-    }
+    object->numInstances = numNotDestroyed;
+    instances_shrink(object);
+    token_index_rebuild(object);
     nssPKIObject_Unlock(object);
     return status;
 }
@@ -352,7 +725,7 @@ nssPKIObject_GetTokens (
 )
 {
     NSSToken **tokens = NULL;
-    nssPKIObject_Lock(object);
+    nssPKIObject_LockShared(object);
     if (object->numInstances > 0) {
 	tokens = nss_ZNEWARRAY(NULL, NSSToken *, object->numInstances + 1);
 	if (tokens) {
@@ -362,7 +735,7 @@ nssPKIObject_GetTokens (
 	    }
 	}
     }
-    nssPKIObject_Unlock(object);
+    nssPKIObject_UnlockShared(object);
     if (statusOpt) *statusOpt = PR_SUCCESS; /* until more logic here */
     return tokens;
 }
@@ -375,17 +748,22 @@ nssPKIObject_GetNicknameForToken (
 {
     PRUint32 i;
     NSSUTF8 *nickname = NULL;
-    nssPKIObject_Lock(object);
-    for (i=0; i<object->numInstances; i++) {
-	if ((!tokenOpt && object->instances[i]->label) ||
-	    (object->instances[i]->token == tokenOpt)) 
-	{
+    nssPKIObject_LockShared(object);
+    if (tokenOpt) {
+	i = find_instance_for_token(object, tokenOpt);
+	if (i < object->numInstances) {
             /* Must copy, see bug 745548 */
 	    nickname = nssUTF8_Duplicate(object->instances[i]->label, NULL);
-	    break;
+	}
+    } else {
+	for (i=0; i<object->numInstances; i++) {
+	    if (object->instances[i]->label) {
+		nickname = nssUTF8_Duplicate(object->instances[i]->label, NULL);
+		break;
+	    }
 	}
     }
-    nssPKIObject_Unlock(object);
+    nssPKIObject_UnlockShared(object);
     return nickname;
 }
 
@@ -399,7 +777,7 @@ nssPKIObject_GetInstances (
     if (object->numInstances == 0) {
 	return (nssCryptokiObject **)NULL;
     }
-    nssPKIObject_Lock(object);
+    nssPKIObject_LockShared(object);
     instances = nss_ZNEWARRAY(NULL, nssCryptokiObject *, 
                               object->numInstances + 1);
     if (instances) {
@@ -407,10 +785,24 @@ nssPKIObject_GetInstances (
 	    instances[i] = nssCryptokiObject_Clone(object->instances[i]);
 	}
     }
-    nssPKIObject_Unlock(object);
+    nssPKIObject_UnlockShared(object);
     return instances;
 }
 
+/* release one array reference to a certificate */
+static void
+release_certificate(NSSCertificate *c)
+{
+    if (c->decoding) {
+	CERTCertificate *cc = STAN_GetCERTCertificate(c);
+	if (cc) {
+	    CERT_DestroyCertificate(cc);
+	}
+	return;
+    }
+    nssCertificate_Destroy(c);
+}
+
 NSS_IMPLEMENT void
 nssCertificateArray_Destroy (
   NSSCertificate **certs
@@ -419,14 +811,7 @@ nssCertificateArray_Destroy (
     if (certs) {
 	NSSCertificate **certp;
 	for (certp = certs; *certp; certp++) {
-	    if ((*certp)->decoding) {
-		CERTCertificate *cc = STAN_GetCERTCertificate(*certp);
-		if (cc) {
-		    CERT_DestroyCertificate(cc);
-		}
-		continue;
-	    }
-	    nssCertificate_Destroy(*certp);
+	    release_certificate(*certp);
 	}
 	nss_ZFreeIf(certs);
     }
@@ -473,112 +858,330 @@ nssCertificateArray_Join (
     }
 }
 
-NSS_IMPLEMENT NSSCertificate * 
-nssCertificateArray_FindBestCertificate (
-  NSSCertificate **certs, 
-  NSSTime *timeOpt,
-  const NSSUsage *usage,
-  NSSPolicies *policiesOpt
-)
+static PLHashNumber
+hash_pointer(const void *key)
 {
-    NSSCertificate *bestCert = NULL;
-    nssDecodedCert *bestdc = NULL;
-    NSSTime *time, sTime;
-    PRBool bestCertMatches = PR_FALSE;
-    PRBool thisCertMatches;
-    PRBool bestCertIsValidAtTime = PR_FALSE;
-    PRBool bestCertIsTrusted = PR_FALSE;
+    PRUint64 h = (PRUint64)(PRUptrdiff)key * 0x9e3779b97f4a7c15ULL;
+    return (PLHashNumber)(h >> 32);
+}
 
-    if (timeOpt) {
-	time = timeOpt;
+/* Join numArrays NULL-terminated arrays (any of which may be NULL) into
+ * one, sizing and copying once.  Like nssCertificateArray_Join, the input
+ * arrays are consumed: their references move to the result and the
+ * arrays themselves are freed.  If dedupe is set, repeated certificate
+ * pointers (the same cert found on several tokens) appear once, and the
+ * extra references are released.  If there are no certs at all, NULL is
+ * returned, as nssCertificateArray_Join does for two NULL arrays.
+ */
+NSS_IMPLEMENT NSSCertificate **
+nssCertificateArray_JoinMany (
+  NSSCertificate ***arrays,
+  PRUint32 numArrays,
+  PRBool dedupe
+)
+{
+    NSSCertificate **certs, **cp;
+    PLHashTable *seen = NULL;
+    PRUint32 i, count = 0;
+    for (i=0; i<numArrays; i++) {
+	if (arrays[i]) {
+	    for (cp = arrays[i]; *cp; cp++) count++;
+	}
+    }
+    if (count == 0) {
+	/* as nssCertificateArray_Join(NULL, NULL) */
+	certs = NULL;
     } else {
-	NSSTime_Now(&sTime);
-	time = &sTime;
+	certs = nss_ZNEWARRAY(NULL, NSSCertificate *, count + 1);
+    }
+    if (certs && dedupe && count > 1) {
+	seen = PL_NewHashTable(count, hash_pointer, PL_CompareValues, 
+	                       PL_CompareValues, NULL, NULL);
+	if (!seen) {
+	    nss_ZFreeIf(certs);
+	    certs = NULL;
+	}
     }
     if (!certs) {
-	return (NSSCertificate *)NULL;
+	for (i=0; i<numArrays; i++) {
+	    nss_ZFreeIf(arrays[i]);
+	}
+	return (NSSCertificate **)NULL;
     }
-    for (; *certs; certs++) {
-	nssDecodedCert *dc;
-	NSSCertificate *c = *certs;
-	dc = nssCertificate_GetDecoding(c);
-	if (!dc) continue;
-	thisCertMatches = dc->matchUsage(dc, usage);
-	if (!bestCert) {
-	    /* always take the first cert, but remember whether or not
-	     * the usage matched 
-	     */
-	    bestCert = nssCertificate_AddRef(c);
-	    bestCertMatches = thisCertMatches;
-	    bestdc = dc;
+    count = 0;
+    for (i=0; i<numArrays; i++) {
+	if (!arrays[i]) {
 	    continue;
-	} else {
-	    if (bestCertMatches && !thisCertMatches) {
-		/* if already have a cert for this usage, and if this cert 
-		 * doesn't have the correct usage, continue
-		 */
-		continue;
-	    } else if (!bestCertMatches && thisCertMatches) {
-		/* this one does match usage, replace the other */
-		nssCertificate_Destroy(bestCert);
-		bestCert = nssCertificate_AddRef(c);
-		bestCertMatches = thisCertMatches;
-		bestdc = dc;
-		continue;
+	}
+	for (cp = arrays[i]; *cp; cp++) {
+	    if (seen) {
+		if (PL_HashTableLookup(seen, *cp)) {
+		    release_certificate(*cp);
+		    continue;
+		}
+		PL_HashTableAdd(seen, *cp, *cp);
 	    }
-	    /* this cert match as well as any cert we've found so far, 
-	     * defer to time/policies 
-	     * */
-	}
-	/* time */
-	if (bestCertIsValidAtTime || bestdc->isValidAtTime(bestdc, time)) {
-	    /* The current best cert is valid at time */
-	    bestCertIsValidAtTime = PR_TRUE;
-	    if (!dc->isValidAtTime(dc, time)) {
-		/* If the new cert isn't valid at time, it's not better */
-		continue;
+	    certs[count++] = *cp;
+	}
+	nss_ZFreeIf(arrays[i]);
+    }
+    if (seen) {
+	PL_HashTableDestroy(seen);
+    }
+    return certs;
+}
+
+/* Decoded-cert memos
+ *
+ * Best-certificate selection on a hot subject asks the same decodings
+ * the same questions call after call.  Each nssDecodedCert remembers its
+ * last matchUsage answer (usageMemo) and, for PKIX certs, its validity
+ * period (notBefore, notAfter).  Usage match depends only on the cert,
+ * so neither goes stale.  The memo is one 32-bit word read and written
+ * atomically:
+ *
+ *   bit 31      memo is valid
+ *   bit 30      the answer
+ *   bits 0-9    the usage asked about
+ *
+ * Trust answers are not memoized: trust changes in CERT_ChangeCertTrust,
+ * when trust objects arrive on a new token and when the builtins load,
+ * and nothing here learns of those changes.
+ */
+#define DC_MEMO_VALID      0x80000000U
+#define DC_MEMO_TRUE       0x40000000U
+#define DC_MEMO_USAGE_MASK 0x000003ffU
+
+static PRUint32
+dc_usage_key(const NSSUsage *usage)
+{
+    return (((PRUint32)usage->nss3usage & 0xff) |
+            (usage->anyUsage ? 0x100 : 0) |
+            (usage->nss3lookingForCA ? 0x200 : 0)) & DC_MEMO_USAGE_MASK;
+}
+
+static PRBool
+dc_memo_lookup(PRInt32 *memo, PRUint32 key, PRBool *answer)
+{
+    PRUint32 m = (PRUint32)PR_ATOMIC_ADD(memo, 0);
+    if ((m & ~DC_MEMO_TRUE) != (DC_MEMO_VALID | key)) {
+	return PR_FALSE;
+    }
+    *answer = (m & DC_MEMO_TRUE) ? PR_TRUE : PR_FALSE;
+    return PR_TRUE;
+}
+
+static void
+dc_memo_store(PRInt32 *memo, PRUint32 key, PRBool answer)
+{
+    PRUint32 m = DC_MEMO_VALID | key | (answer ? DC_MEMO_TRUE : 0);
+    (void)PR_ATOMIC_SET(memo, (PRInt32)m);
+}
+
+static PRBool
+dc_matchUsage(nssDecodedCert *dc, const NSSUsage *usage)
+{
+    PRUint32 key = dc_usage_key(usage);
+    PRBool answer;
+    if (!dc_memo_lookup(&dc->usageMemo, key, &answer)) {
+	answer = dc->matchUsage(dc, usage);
+	dc_memo_store(&dc->usageMemo, key, answer);
+    }
+    return answer;
+}
+
+/* A time inside the cached validity period is answered here.  Anything
+ * else goes to the decoding, which also applies the not-before slop and
+ * any validity override.
+ */
+static PRBool
+dc_isValidAtTime(nssDecodedCert *dc, NSSTime *time)
+{
+    if (dc->type == NSSCertificateType_PKIX) {
+	if (!PR_ATOMIC_ADD(&dc->haveTimes, 0)) {
+	    PRTime notBefore, notAfter;
+	    if (CERT_GetCertTimes((CERTCertificate *)dc->data, 
+	                          &notBefore, &notAfter) == SECSuccess) {
+		/* racing threads store the same values */
+		dc->notBefore = notBefore;
+		dc->notAfter = notAfter;
+		(void)PR_ATOMIC_SET(&dc->haveTimes, 1);
 	    }
-	} else {
-	    /* The current best cert is not valid at time */
-	    if (dc->isValidAtTime(dc, time)) {
-		/* If the new cert is valid at time, it's better */
-		nssCertificate_Destroy(bestCert);
-		bestCert = nssCertificate_AddRef(c);
-		bestdc = dc;
-		bestCertIsValidAtTime = PR_TRUE;
-		continue;
+	}
+	if (PR_ATOMIC_ADD(&dc->haveTimes, 0)) {
+	    PRTime t = NSSTime_GetPRTime(time);
+	    if (t >= dc->notBefore && t <= dc->notAfter) {
+		return PR_TRUE;
 	    }
 	}
-	/* Either they are both valid at time, or neither valid.
-	 * If only one is trusted for this usage, take it.
+    }
+    return dc->isValidAtTime(dc, time);
+}
+
+/* A candidate in best-certificate selection.  Each predicate of the
+ * decoding is evaluated at most once per candidate, and only when the
+ * comparison actually reaches it.
+ */
+typedef struct
+{
+  NSSCertificate *cert;
+  nssDecodedCert *dc;
+  PRBool matchesUsage;
+  PRInt8 validAtTime; /* -1 until evaluated */
+  PRInt8 trusted;     /* -1 until evaluated */
+} cert_candidate;
+
+static PRBool
+candidate_is_valid_at_time(cert_candidate *cand, NSSTime *time)
+{
+    if (cand->validAtTime < 0) {
+	cand->validAtTime = dc_isValidAtTime(cand->dc, time) ? 1 : 0;
+    }
+    return (PRBool)cand->validAtTime;
+}
+
+static PRBool
+candidate_is_trusted(cert_candidate *cand, const NSSUsage *usage)
+{
+    if (cand->trusted < 0) {
+	cand->trusted = cand->dc->isTrustedForUsage(cand->dc, usage) ? 1 : 0;
+    }
+    return (PRBool)cand->trusted;
+}
+
+/* Is cand a better choice than best?  In order of precedence, prefer the
+ * cert that matches the usage, then the one valid at time, then the one
+ * trusted for the usage, and otherwise the newer one.
+ */
+static PRBool
+candidate_is_better (
+  cert_candidate *cand,
+  cert_candidate *best,
+  NSSTime *time,
+  const NSSUsage *usage
+)
+{
+    PRBool a, b;
+    if (cand->matchesUsage != best->matchesUsage) {
+	return cand->matchesUsage;
+    }
+    a = candidate_is_valid_at_time(cand, time);
+    b = candidate_is_valid_at_time(best, time);
+    if (a != b) {
+	return a;
+    }
+    a = candidate_is_trusted(cand, usage);
+    b = candidate_is_trusted(best, usage);
+    if (a != b) {
+	return a;
+    }
+    /* policies */
+    /* XXX later -- defer to policies */
+    return !best->dc->isNewerThan(best->dc, cand->dc);
+}
+
+NSS_IMPLEMENT NSSCertificate * 
+nssCertificateArray_FindBestCertificate (
+  NSSCertificate **certs, 
+  NSSTime *timeOpt,
+  const NSSUsage *usage,
+  NSSPolicies *policiesOpt
+)
+{
+    cert_candidate best, cand;
+    NSSTime *time, sTime;
+
+    if (timeOpt) {
+	time = timeOpt;
+    } else {
+	NSSTime_Now(&sTime);
+	time = &sTime;
+    }
+    if (!certs) {
+	return (NSSCertificate *)NULL;
+    }
+    best.cert = NULL;
+    for (; *certs; certs++) {
+	cand.cert = *certs;
+	cand.dc = nssCertificate_GetDecoding(cand.cert);
+	if (!cand.dc) continue;
+	cand.matchesUsage = dc_matchUsage(cand.dc, usage);
+	cand.validAtTime = cand.trusted = -1;
+	/* always take the first cert, but remember whether or not
+	 * the usage matched 
 	 */
-	if (bestCertIsTrusted || bestdc->isTrustedForUsage(bestdc, usage)) {
-	    bestCertIsTrusted = PR_TRUE;
-	    if (!dc->isTrustedForUsage(dc, usage)) {
-	        continue;
-	    }
-	} else {
-	    /* The current best cert is not trusted */
-	    if (dc->isTrustedForUsage(dc, usage)) {
-		/* If the new cert is trusted, it's better */
-		nssCertificate_Destroy(bestCert);
-		bestCert = nssCertificate_AddRef(c);
-		bestdc = dc;
-		bestCertIsTrusted = PR_TRUE;
-	        continue;
+	if (!best.cert || candidate_is_better(&cand, &best, time, usage)) {
+	    best = cand;
+	}
+    }
+    return best.cert ? nssCertificate_AddRef(best.cert) 
+                     : (NSSCertificate *)NULL;
+}
+
+/* Select the best certificate for each of several usages in one pass.
+ * rvBest[i] receives the cert nssCertificateArray_FindBestCertificate
+ * would return for usages[i] (with a reference added), or NULL.  The
+ * decoding and validity at time of each cert are shared by all usages.
+ */
+NSS_IMPLEMENT PRStatus
+nssCertificateArray_FindBestCertificatesForUsages (
+  NSSCertificate **certs, 
+  NSSTime *timeOpt,
+  const NSSUsage *usages,
+  PRUint32 numUsages,
+  NSSPolicies *policiesOpt,
+  NSSCertificate **rvBest
+)
+{
+    cert_candidate *best, cand;
+    NSSTime *time, sTime;
+    PRUint32 i;
+
+    for (i=0; i<numUsages; i++) {
+	rvBest[i] = NULL;
+    }
+    if (!certs || numUsages == 0) {
+	return PR_SUCCESS;
+    }
+    best = nss_ZNEWARRAY(NULL, cert_candidate, numUsages);
+    if (!best) {
+	return PR_FAILURE;
+    }
+    if (timeOpt) {
+	time = timeOpt;
+    } else {
+	NSSTime_Now(&sTime);
+	time = &sTime;
+    }
+    for (; *certs; certs++) {
+	PRInt8 validAtTime = -1;
+	cand.cert = *certs;
+	cand.dc = nssCertificate_GetDecoding(cand.cert);
+	if (!cand.dc) continue;
+	for (i=0; i<numUsages; i++) {
+	    /* not dc_matchUsage: its memo holds one usage, and cycling
+	     * through several would only replace it each time
+	     */
+	    cand.matchesUsage = cand.dc->matchUsage(cand.dc, &usages[i]);
+	    cand.validAtTime = validAtTime;
+	    cand.trusted = -1;
+	    if (!best[i].cert || 
+	        candidate_is_better(&cand, &best[i], time, &usages[i])) {
+		best[i] = cand;
 	    }
+	    /* keep the validity result, if it was needed, for the
+	     * remaining usages
+	     */
+	    validAtTime = cand.validAtTime;
 	}
-	/* Otherwise, take the newer one. */
-	if (!bestdc->isNewerThan(bestdc, dc)) {
-	    nssCertificate_Destroy(bestCert);
-	    bestCert = nssCertificate_AddRef(c);
-	    bestdc = dc;
-	    continue;
+    }
+    for (i=0; i<numUsages; i++) {
+	if (best[i].cert) {
+	    rvBest[i] = nssCertificate_AddRef(best[i].cert);
 	}
-	/* policies */
-	/* XXX later -- defer to policies */
     }
-    return bestCert;
+    nss_ZFreeIf(best);
+    return PR_SUCCESS;
 }
 
 NSS_IMPLEMENT PRStatus
@@ -632,8 +1235,10 @@ typedef enum
  * Here are the uid sets:
  *
  * NSSCertificate ==>  { issuer, serial }
- * NSSPrivateKey
+ * NSSPrivateKey, NSSPublicKey
  *         (RSA) ==> { modulus, public exponent }
+ *          (EC) ==> { EC point, - }
+ *       (other) ==> { token, handle } (never shared across tokens)
  *
  */
 
@@ -647,6 +1252,7 @@ typedef struct
 {
   PRCList link;
   PRBool haveObject;
+  PRBool converting; /* object is being converted with the lock released */
   nssPKIObject *object;
   NSSItem uid[MAX_ITEMS_FOR_UID];
 } 
@@ -685,18 +1291,124 @@ struct nssPKIObjectCollectionStr
   PRUint32 size;
   pkiObjectType objectType;
   void           (*      destroyObject)(nssPKIObject *o);
-  PRStatus       (*   getUIDFromObject)(nssPKIObject *o, NSSItem *uid);
+  PRStatus       (*   getUIDFromObject)(nssPKIObject *o, NSSItem *uid,
+                                        NSSArena *arena);
   PRStatus       (* getUIDFromInstance)(nssCryptokiObject *co, NSSItem *uid, 
                                         NSSArena *arena);
   nssPKIObject * (*       createObject)(nssPKIObject *o);
+  /* createObject split in two, for callers that create many objects:
+   * createUncachedObject may run on any thread, and cacheObjects (NULL
+   * if the type is not cached) enters them in the trust domain cache,
+   * one at a time, replacing any already cached.
+   */
+  nssPKIObject * (* createUncachedObject)(nssPKIObject *o);
+  void           (*       cacheObjects)(NSSTrustDomain *td, 
+                                        nssPKIObject **objects,
+                                        PRUint32 numObjects);
   nssPKILockType lockType; /* type of lock to use for new proto-objects */
+  PZLock *lock; /* guards the tables and size; NULL unless concurrent */
+  PZCondVar *converted; /* on lock; signalled when a conversion ends */
+};
+
+#define COLLECTION_LOCK(c) \
+    PR_BEGIN_MACRO if ((c)->lock) PZ_Lock((c)->lock); PR_END_MACRO
+#define COLLECTION_UNLOCK(c) \
+    PR_BEGIN_MACRO if ((c)->lock) PZ_Unlock((c)->lock); PR_END_MACRO
+
+/* Allocation ops for the collection hash tables.  The table header,
+ * bucket arrays and entries all come from the collection arena, so
+ * building a collection does not malloc per entry and destroying it is
+ * a single nssArena_Destroy.  Individual frees are no-ops; memory from
+ * a table grow or a removed entry is reclaimed with the arena.
+ */
+static void *
+collection_allocTable(void *pool, PRSize size)
+{
+    return nss_ZAlloc((NSSArena *)pool, (PRUint32)size);
+}
+
+static void
+collection_freeTable(void *pool, void *item)
+{
+}
+
+static PLHashEntry *
+collection_allocEntry(void *pool, const void *key)
+{
+    return nss_ZNEW((NSSArena *)pool, PLHashEntry);
+}
+
+static void
+collection_freeEntry(void *pool, PLHashEntry *he, PRUintn flag)
+{
+}
+
+static PLHashAllocOps collection_hashAllocOps = {
+    collection_allocTable,
+    collection_freeTable,
+    collection_allocEntry,
+    collection_freeEntry
 };
 
+/* (Re)create the collection hash tables, sized for sizeHint objects.
+ * PLHashTable grows by doubling once it is 7/8 full, so leave some
+ * headroom above the hint; a table created with the expected count
+ * then never needs to rehash.
+ */
+static PRStatus
+collection_createHashTables (
+  nssPKIObjectCollection *collection,
+  PRUint32 sizeHint
+)
+{
+    PLHashTable *objects, *instances;
+    if (sizeHint) {
+	sizeHint += sizeHint >> 2;
+    }
+    objects = PL_NewHashTable(sizeHint, hash_object, 
+                              compare_objects, PL_CompareValues,
+                              &collection_hashAllocOps, collection->arena);
+    instances = PL_NewHashTable(sizeHint, hash_instance, 
+                                compare_instances, PL_CompareValues, 
+                                &collection_hashAllocOps, collection->arena);
+    if (!objects || !instances) {
+	return PR_FAILURE;
+    }
+    collection->PKIobjecthashtable = objects;
+    collection->PKIinstancehashtable = instances;
+    return PR_SUCCESS;
+}
+
+/* If nothing has been added yet, presize the hash tables for sizeHint
+ * objects.  Once the collection has entries this is a no-op, since
+ * PLHashTable cannot be resized on request.  PLHashTable grows once
+ * it holds n - n/8 entries for n buckets, so that is the limit the
+ * hint is checked against, not the bucket count.
+ */
+static void
+collection_reserve (
+  nssPKIObjectCollection *collection,
+  PRUint32 sizeHint
+)
+{
+    PRUint32 n, limit;
+    if (collection->PKIobjecthashtable->nentries != 0 ||
+        collection->PKIinstancehashtable->nentries != 0) {
+	return;
+    }
+    n = 1U << (PL_HASH_BITS - collection->PKIobjecthashtable->shift);
+    limit = n - (n >> 3);
+    if (sizeHint > limit) {
+	(void)collection_createHashTables(collection, sizeHint);
+    }
+}
+
 static nssPKIObjectCollection *
 nssPKIObjectCollection_Create (
   NSSTrustDomain *td,
   NSSCryptoContext *ccOpt,
-  nssPKILockType lockType
+  nssPKILockType lockType,
+  PRUint32 sizeHint
 )
 {
     NSSArena *arena;
@@ -709,13 +1421,10 @@ nssPKIObjectCollection_Create (
     if (!rvCollection) {
 	goto loser;
     }
-    rvCollection->PKIobjecthashtable = PL_NewHashTable(0, hash_object, 
-                                                       compare_objects, PL_CompareValues,
-                                                             NULL, NULL);
-    rvCollection->PKIinstancehashtable = PL_NewHashTable(0, hash_instance, 
-                                                         compare_instances, PL_CompareValues, 
-                                                               NULL, NULL);
     rvCollection->arena = arena;
+    if (collection_createHashTables(rvCollection, sizeHint) != PR_SUCCESS) {
+	goto loser;
+    }
     rvCollection->td = td; /* XXX */
     rvCollection->cc = ccOpt;
     rvCollection->lockType = lockType;
@@ -731,10 +1440,15 @@ nssPKIObjectCollection_Destroy (
 )
 {
     if (collection) {
-  /* destroy all elements of collection*/
-  PL_HashTableDestroy(collection->PKIobjecthashtable);
-  PL_HashTableDestroy(collection->PKIinstancehashtable);
-	/* then destroy it */
+	if (collection->converted) {
+	    PZ_DestroyCondVar(collection->converted);
+	}
+	if (collection->lock) {
+	    PZ_DestroyLock(collection->lock);
+	}
+	/* the hash tables live in the collection arena (see
+	 * collection_hashAllocOps), so this frees them as well
+	 */
 	nssArena_Destroy(collection->arena);
     }
 }
@@ -747,61 +1461,164 @@ nssPKIObjectCollection_Count (
     return collection->size;
 }
 
+/* Allow several threads to add to the collection at once, through
+ * AddObject, AddInstances and AddInstanceAsObject.  Must be called
+ * before the collection is shared.  Enumerating the collection (GetObjects,
+ * Traverse, iterators) is still single-threaded and must not overlap
+ * with adds.
+ */
+NSS_IMPLEMENT PRStatus
+nssPKIObjectCollection_SetConcurrent (
+  nssPKIObjectCollection *collection
+)
+{
+    if (!collection->lock) {
+	collection->lock = PZ_NewLock(nssILockOther);
+	if (!collection->lock) {
+	    return PR_FAILURE;
+	}
+	collection->converted = PZ_NewCondVar(collection->lock);
+	if (!collection->converted) {
+	    PZ_DestroyLock(collection->lock);
+	    collection->lock = NULL;
+	    return PR_FAILURE;
+	}
+    }
+    return PR_SUCCESS;
+}
+
+/* Choose the lock type of the proto-objects the collection creates for
+ * new instances, in place of the type's default (nssPKIMonitor for
+ * certificates, nssPKILock otherwise).  nssPKIRWLock lets the read-only
+ * accessors, which take the shared lock (nssPKIObject_GetTokens,
+ * GetInstances, HasInstance, GetNicknameForToken), run concurrently, but
+ * unlike a monitor it is not reentrant.  nssPKIStripedLock saves a
+ * monitor per object, but unrelated objects may share a stripe, so a
+ * thread holding one striped object's lock must not take another
+ * object's lock: two threads doing so in opposite orders can deadlock.
+ * Do not use it for objects that are locked in a nested way, such as a
+ * cert whose lock is held while its trust object is locked (pki3hack.c).
+ * Certificate collections accept only nssPKIMonitor, since
+ * nssCertificate_Create requires it.  Fails once the collection holds
+ * objects, since the existing ones would keep their old lock type.
+ */
+NSS_IMPLEMENT PRStatus
+nssPKIObjectCollection_SetObjectLockType (
+  nssPKIObjectCollection *collection,
+  nssPKILockType lockType
+)
+{
+    PRStatus status = PR_FAILURE;
+    switch (lockType) {
+    case nssPKIMonitor:
+    case nssPKILock:
+    case nssPKIRWLock:
+    case nssPKIStripedLock:
+        break;
+    default:
+        nss_SetError(NSS_ERROR_INVALID_ARGUMENT);
+        return PR_FAILURE;
+    }
+    if (collection->objectType == pkiObjectType_Certificate &&
+        lockType != nssPKIMonitor) 
+    {
+	nss_SetError(NSS_ERROR_INVALID_ARGUMENT);
+	return PR_FAILURE;
+    }
+    COLLECTION_LOCK(collection);
+    if (collection->size == 0) {
+	collection->lockType = lockType;
+	status = PR_SUCCESS;
+    } else {
+	nss_SetError(NSS_ERROR_INVALID_ARGUMENT);
+    }
+    COLLECTION_UNLOCK(collection);
+    return status;
+}
+
 NSS_IMPLEMENT PRStatus
 nssPKIObjectCollection_AddObject (
   nssPKIObjectCollection *collection,
   nssPKIObject *object
 )
 {
-    pkiObjectCollectionNode *node = nss_ZNEW(collection->arena, pkiObjectCollectionNode);
+    pkiObjectCollectionNode *node;
+    /* everything that allocates from the collection arena, including the
+     * uid fetch, happens with the collection locked
+     */
+    COLLECTION_LOCK(collection);
+    node = nss_ZNEW(collection->arena, pkiObjectCollectionNode);
     if (!node) {
+	COLLECTION_UNLOCK(collection);
 	return PR_FAILURE;
     }
     node->haveObject = PR_TRUE;
     node->object = nssPKIObject_AddRef(object);
-    (*collection->getUIDFromObject)(object, node->uid);
-    PL_HashTableAdd(collection->PKIobjecthashtable, &node->uid, node);
+    (*collection->getUIDFromObject)(object, node->uid, collection->arena);
+    if (!PL_HashTableAdd(collection->PKIobjecthashtable, &node->uid, node)) {
+	COLLECTION_UNLOCK(collection);
+	(void)nssPKIObject_Destroy(object);
+	return PR_FAILURE;
+    }
     collection->size++;
+    COLLECTION_UNLOCK(collection);
     return PR_SUCCESS;
 }
 
-static pkiObjectCollectionNode *
-add_object_instance (
+/* Add another instance to the object of an existing node.  On failure
+ * the instance is destroyed.  Caller holds the collection lock, if any.
+ *
+ * The node may be in the middle of a conversion by
+ * nssPKIObjectCollection_AddInstanceAsObject, which reads the
+ * proto-object with the lock released, so wait for it to finish.  If it
+ * failed, the node has no object left to add to.
+ *
+ * If the instance table add fails, the node still holds the instance and
+ * only the { token, handle } shortcut is lost: adding the same instance
+ * again finds the node by uid instead.  nssPKIObject_AddInstance then
+ * folds the duplicate into the existing instance and destroys it, so it
+ * must not go into the instance table in that case.
+ */
+static PRStatus
+add_instance_to_node (
   nssPKIObjectCollection *collection,
-  nssCryptokiObject *instance,
-  PRBool *foundIt
+  pkiObjectCollectionNode *node,
+  nssCryptokiObject *instance
 )
 {
-    PRUint32 i;
-    PRStatus status;
-    pkiObjectCollectionNode *node;
-    nssArenaMark *mark = NULL;
-    NSSItem uid[MAX_ITEMS_FOR_UID];
-    nsslibc_memset(uid, 0, sizeof uid);
-    /* The list is traversed twice, first (here) looking to match the
-     * { token, handle } tuple, and if that is not found, below a search
-     * for unique identifier is done.  Here, a match means this exact object
-     * instance is already in the collection, and we have nothing to do.
-     */
-    *foundIt = PR_FALSE;
-    node = PL_HashTableLookup(collection->PKIinstancehashtable, instance);
-    if (node) {
-	/* The collection is assumed to take over the instance.  Since we
-	 * are not using it, it must be destroyed.
-	 */
+    PRBool haveIt;
+    while (node->converting) {
+	PZ_WaitCondVar(collection->converted, PR_INTERVAL_NO_TIMEOUT);
+    }
+    if (!node->object) {
 	nssCryptokiObject_Destroy(instance);
-	*foundIt = PR_TRUE;
-	return node;
+	return PR_FAILURE;
     }
-    mark = nssArena_Mark(collection->arena);
-    if (!mark) {
-	goto loser;
+    haveIt = nssPKIObject_HasInstance(node->object, instance);
+    if (nssPKIObject_AddInstance(node->object, instance) != PR_SUCCESS) {
+	nssCryptokiObject_Destroy(instance);
+	return PR_FAILURE;
     }
-    status = (*collection->getUIDFromInstance)(instance, uid, 
-                                               collection->arena);
-    if (status != PR_SUCCESS) {
-	goto loser;
+    if (!haveIt) {
+	(void)PL_HashTableAdd(collection->PKIinstancehashtable, 
+	                      instance, node);
     }
+    return PR_SUCCESS;
+}
+
+/* Add an instance, whose uid has already been fetched into the collection
+ * arena, to the collection.  The instance must not already be in the
+ * instance table.  On failure the instance is destroyed.
+ */
+static pkiObjectCollectionNode *
+insert_object_instance (
+  nssPKIObjectCollection *collection,
+  nssCryptokiObject *instance,
+  NSSItem *uid
+)
+{
+    PRUint32 i;
+    pkiObjectCollectionNode *node;
     /* Search for unique identifier.  A match here means the object exists 
      * in the collection, but does not have this instance, so the instance 
      * needs to be added.
@@ -809,29 +1626,190 @@ add_object_instance (
     node = PL_HashTableLookup(collection->PKIobjecthashtable, uid);
     if (node) {
 	/* This is an object with multiple instances */
-	status = nssPKIObject_AddInstance(node->object, instance);
-    } else {
-	/* This is a completely new object.  Create a node for it. */
-	node = nss_ZNEW(collection->arena, pkiObjectCollectionNode);
-	if (!node) {
-	    goto loser;
-	}
-	node->object = nssPKIObject_Create(NULL, instance, 
-	                                   collection->td, collection->cc,
-                                           collection->lockType);
-	if (!node->object) {
-	    goto loser;
-	}
-	for (i=0; i<MAX_ITEMS_FOR_UID; i++) {
-	    node->uid[i] = uid[i];
+	if (add_instance_to_node(collection, node, instance) != PR_SUCCESS) {
+	    return (pkiObjectCollectionNode *)NULL;
 	}
-	node->haveObject = PR_FALSE;
-  PL_HashTableAdd(collection->PKIobjecthashtable, &node->uid, node);
-  collection->size++;
-	status = PR_SUCCESS;
+	return node;
     }
-  PL_HashTableAdd(collection->PKIinstancehashtable, instance, node);
-  nssArena_Unmark(collection->arena, mark);
+    /* This is a completely new object.  Create a node for it. */
+    node = nss_ZNEW(collection->arena, pkiObjectCollectionNode);
+    if (!node) {
+	goto loser;
+    }
+    node->object = nssPKIObject_Create(NULL, instance, 
+                                       collection->td, collection->cc,
+                                       collection->lockType);
+    if (!node->object) {
+	goto loser;
+    }
+    for (i=0; i<MAX_ITEMS_FOR_UID; i++) {
+	node->uid[i] = uid[i];
+    }
+    node->haveObject = PR_FALSE;
+    if (!PL_HashTableAdd(collection->PKIobjecthashtable, &node->uid, node)) {
+	/* the proto-object owns the instance now */
+	(void)nssPKIObject_Destroy(node->object);
+	return (pkiObjectCollectionNode *)NULL;
+    }
+    collection->size++;
+    /* as in add_instance_to_node, the node is usable without this entry */
+    (void)PL_HashTableAdd(collection->PKIinstancehashtable, instance, node);
+    return node;
+loser:
+    nssCryptokiObject_Destroy(instance);
+    return (pkiObjectCollectionNode *)NULL;
+}
+
+/* Free a uid fetched into the heap (a NULL arena). */
+static void
+free_heap_uid(NSSItem *uid)
+{
+    PRUint32 i;
+    for (i=0; i<MAX_ITEMS_FOR_UID; i++) {
+	nss_ZFreeIf(uid[i].data);
+	uid[i].data = NULL;
+	uid[i].size = 0;
+    }
+}
+
+/* insert_object_instance for a uid fetched into the heap.  The uid is
+ * copied into the collection arena only if the instance starts a new
+ * node; the caller still frees the heap copy.
+ */
+static pkiObjectCollectionNode *
+insert_heap_uid_instance (
+  nssPKIObjectCollection *collection,
+  nssCryptokiObject *instance,
+  NSSItem *heapUID
+)
+{
+    PRUint32 i;
+    pkiObjectCollectionNode *node;
+    NSSItem uid[MAX_ITEMS_FOR_UID];
+    node = PL_HashTableLookup(collection->PKIobjecthashtable, heapUID);
+    if (node) {
+	if (add_instance_to_node(collection, node, instance) != PR_SUCCESS) {
+	    return (pkiObjectCollectionNode *)NULL;
+	}
+	return node;
+    }
+    nsslibc_memset(uid, 0, sizeof uid);
+    for (i=0; i<MAX_ITEMS_FOR_UID; i++) {
+	if (heapUID[i].size > 0 &&
+	    !nssItem_Duplicate(&heapUID[i], collection->arena, &uid[i])) {
+	    nssCryptokiObject_Destroy(instance);
+	    return (pkiObjectCollectionNode *)NULL;
+	}
+    }
+    return insert_object_instance(collection, instance, uid);
+}
+
+/* add_object_instance for concurrent collections.  The uid is fetched
+ * into the heap with the collection unlocked, so producers on different
+ * threads overlap their token round trips.  The collection arena is only
+ * touched with the lock held: the uid is copied into it there, if it
+ * starts a new node.  (The fetch cannot go straight to the collection
+ * arena, since nssCKObject_GetAttributes marks and releases the arena it
+ * is given, which would race with the table allocations of other
+ * threads.)
+ */
+static pkiObjectCollectionNode *
+add_object_instance_locked (
+  nssPKIObjectCollection *collection,
+  nssCryptokiObject *instance,
+  PRBool *foundIt
+)
+{
+    pkiObjectCollectionNode *node;
+    NSSItem uid[MAX_ITEMS_FOR_UID];
+    nsslibc_memset(uid, 0, sizeof uid);
+    PZ_Lock(collection->lock);
+    node = PL_HashTableLookup(collection->PKIinstancehashtable, instance);
+    PZ_Unlock(collection->lock);
+    if (!node) {
+	if ((*collection->getUIDFromInstance)(instance, uid, 
+	                                      NULL) != PR_SUCCESS) {
+	    free_heap_uid(uid);
+	    nssCryptokiObject_Destroy(instance);
+	    return (pkiObjectCollectionNode *)NULL;
+	}
+	PZ_Lock(collection->lock);
+	/* another thread may have added the same instance meanwhile */
+	node = PL_HashTableLookup(collection->PKIinstancehashtable, instance);
+	if (!node) {
+	    node = insert_heap_uid_instance(collection, instance, uid);
+	    PZ_Unlock(collection->lock);
+	    free_heap_uid(uid);
+	    return node;
+	}
+	PZ_Unlock(collection->lock);
+	free_heap_uid(uid);
+    }
+    nssCryptokiObject_Destroy(instance);
+    *foundIt = PR_TRUE;
+    return node;
+}
+
+static pkiObjectCollectionNode *
+add_object_instance (
+  nssPKIObjectCollection *collection,
+  nssCryptokiObject *instance,
+  PRBool *foundIt
+)
+{
+    PRStatus status;
+    pkiObjectCollectionNode *node;
+    nssArenaMark *mark = NULL;
+    NSSItem uid[MAX_ITEMS_FOR_UID];
+    nsslibc_memset(uid, 0, sizeof uid);
+    /* The list is traversed twice, first (here) looking to match the
+     * { token, handle } tuple, and if that is not found, below a search
+     * for unique identifier is done.  Here, a match means this exact object
+     * instance is already in the collection, and we have nothing to do.
+     */
+    *foundIt = PR_FALSE;
+    if (collection->lock) {
+	return add_object_instance_locked(collection, instance, foundIt);
+    }
+    node = PL_HashTableLookup(collection->PKIinstancehashtable, instance);
+    if (node) {
+	/* The collection is assumed to take over the instance.  Since we
+	 * are not using it, it must be destroyed.
+	 */
+	nssCryptokiObject_Destroy(instance);
+	*foundIt = PR_TRUE;
+	return node;
+    }
+    mark = nssArena_Mark(collection->arena);
+    if (!mark) {
+	goto loser;
+    }
+    status = (*collection->getUIDFromInstance)(instance, uid, 
+                                               collection->arena);
+    if (status != PR_SUCCESS) {
+	goto loser;
+    }
+    node = PL_HashTableLookup(collection->PKIobjecthashtable, uid);
+    if (node) {
+	/* Another instance of an object already in the collection.  The
+	 * node has its own copy of the uid, so return the one just
+	 * fetched to the arena instead of keeping a copy per token the
+	 * object is mirrored on.  Nothing else was allocated since the
+	 * mark.
+	 */
+	nssArena_Release(collection->arena, mark);
+	if (add_instance_to_node(collection, node, instance) != PR_SUCCESS) {
+	    return (pkiObjectCollectionNode *)NULL;
+	}
+	return node;
+    }
+    node = insert_object_instance(collection, instance, uid);
+    if (!node) {
+	/* insert_object_instance destroyed the instance */
+	nssArena_Release(collection->arena, mark);
+	return (pkiObjectCollectionNode *)NULL;
+    }
+    nssArena_Unmark(collection->arena, mark);
     return node;
 loser:
     if (mark) {
@@ -853,6 +1831,13 @@ nssPKIObjectCollection_AddInstances (
     PRBool foundIt;
     pkiObjectCollectionNode *node;
     if (instances) {
+	PRUint32 count = numInstances;
+	if (!count) {
+	    while (instances[count]) count++;
+	}
+	if (!collection->lock) {
+	    collection_reserve(collection, count);
+	}
 	while ((!numInstances || i < numInstances) && *instances) {
 	    if (status == PR_SUCCESS) {
 		node = add_object_instance(collection, *instances, &foundIt);
@@ -871,6 +1856,155 @@ nssPKIObjectCollection_AddInstances (
     return status;
 }
 
+/*
+ * Concurrent multi-token population
+ *
+ * Each token is searched on its own thread, which also fetches the uid
+ * of every instance it finds; those per-instance attribute round trips
+ * are the expensive part.  Once all workers are done, their results are
+ * merged into the collection on the calling thread, so the workers never
+ * touch the hash tables.  The workers fetch the uids into the heap, not
+ * the collection arena: nssCKObject_GetAttributes marks and releases the
+ * arena it is given, so concurrent fetches into one arena would discard
+ * each other's allocations.  The merge copies the uid of
+ * each new node into the collection arena.  In a concurrent collection
+ * (see nssPKIObjectCollection_SetConcurrent) the merge holds the
+ * collection lock, as other producers may be adding at the same time.
+ */
+
+/* Search one token, returning a NULL-terminated array of instances that
+ * the caller takes ownership of.  Called on a worker thread.
+ */
+typedef nssCryptokiObject ** 
+(* nssPKIObjectCollectionSearchFunc)(NSSToken *token, nssSession *session,
+                                     void *arg);
+
+typedef struct
+{
+  nssPKIObjectCollection *collection;
+  NSSToken *token;
+  nssPKIObjectCollectionSearchFunc search;
+  void *arg;
+  nssCryptokiObject **instances; /* NULL entries failed the uid fetch */
+  NSSItem *uids;                 /* MAX_ITEMS_FOR_UID per instance, heap */
+  PRUint32 numInstances;
+} token_search_args;
+
+static void
+token_search_worker(void *arg)
+{
+    token_search_args *args = arg;
+    nssSession *session = nssToken_GetDefaultSession(args->token);
+    PRUint32 i;
+    args->instances = (*args->search)(args->token, session, args->arg);
+    if (!args->instances) {
+	return;
+    }
+    while (args->instances[args->numInstances]) args->numInstances++;
+    args->uids = nss_ZNEWARRAY(NULL, NSSItem, 
+                               args->numInstances * MAX_ITEMS_FOR_UID);
+    for (i=0; i<args->numInstances; i++) {
+	PRStatus status = PR_FAILURE;
+	if (args->uids) {
+	    status = (*args->collection->getUIDFromInstance)(
+	                                       args->instances[i], 
+	                                       &args->uids[i*MAX_ITEMS_FOR_UID],
+	                                       NULL);
+	}
+	if (status != PR_SUCCESS) {
+	    if (args->uids) {
+		free_heap_uid(&args->uids[i*MAX_ITEMS_FOR_UID]);
+	    }
+	    nssCryptokiObject_Destroy(args->instances[i]);
+	    args->instances[i] = NULL;
+	}
+    }
+}
+
+NSS_IMPLEMENT PRStatus
+nssPKIObjectCollection_AddInstancesFromTokens (
+  nssPKIObjectCollection *collection,
+  NSSToken **tokens,
+  PRUint32 numTokens,
+  nssPKIObjectCollectionSearchFunc search,
+  void *arg
+)
+{
+    token_search_args *args;
+    PRThread **threads;
+    PRStatus status = PR_SUCCESS;
+    PRUint32 i, j, total = 0;
+
+    if (numTokens == 0) {
+	return PR_SUCCESS;
+    }
+    args = nss_ZNEWARRAY(NULL, token_search_args, numTokens);
+    threads = nss_ZNEWARRAY(NULL, PRThread *, numTokens);
+    if (!args || !threads) {
+	nss_ZFreeIf(args);
+	nss_ZFreeIf(threads);
+	return PR_FAILURE;
+    }
+    for (i=0; i<numTokens; i++) {
+	args[i].collection = collection;
+	args[i].token = tokens[i];
+	args[i].search = search;
+	args[i].arg = arg;
+    }
+    /* the calling thread searches the first token itself */
+    for (i=1; i<numTokens; i++) {
+	threads[i] = PR_CreateThread(PR_USER_THREAD, token_search_worker,
+	                             &args[i], PR_PRIORITY_NORMAL,
+	                             PR_GLOBAL_THREAD, PR_JOINABLE_THREAD, 0);
+	if (!threads[i]) {
+	    token_search_worker(&args[i]);
+	}
+    }
+    token_search_worker(&args[0]);
+    for (i=1; i<numTokens; i++) {
+	if (threads[i]) {
+	    PR_JoinThread(threads[i]);
+	}
+	total += args[i].numInstances;
+    }
+    total += args[0].numInstances;
+    COLLECTION_LOCK(collection);
+    /* collection_reserve replaces the tables, which is only safe while
+     * no other thread can be adding
+     */
+    if (!collection->lock) {
+	collection_reserve(collection, total);
+    }
+    /* Merge.  Instances of one object on several tokens end up on a
+     * single node through nssPKIObject_AddInstance.
+     */
+    for (i=0; i<numTokens; i++) {
+	for (j=0; j<args[i].numInstances; j++) {
+	    nssCryptokiObject *instance = args[i].instances[j];
+	    NSSItem *uid = &args[i].uids[j*MAX_ITEMS_FOR_UID];
+	    if (!instance) {
+		status = PR_FAILURE;
+		continue;
+	    }
+	    if (PL_HashTableLookup(collection->PKIinstancehashtable, 
+	                           instance)) {
+		/* already in the collection */
+		nssCryptokiObject_Destroy(instance);
+	    } else if (!insert_heap_uid_instance(collection, instance, uid)) {
+		status = PR_FAILURE;
+	    }
+	    free_heap_uid(uid);
+	}
+	nss_ZFreeIf(args[i].instances);
+	nss_ZFreeIf(args[i].uids);
+    }
+    COLLECTION_UNLOCK(collection);
+    nss_ZFreeIf(args);
+    nss_ZFreeIf(threads);
+    return status;
+}
+
+/* caller holds the collection lock, if any */
 static void
 nssPKIObjectCollection_RemoveNode (
    nssPKIObjectCollection *collection,
@@ -881,6 +2015,137 @@ nssPKIObjectCollection_RemoveNode (
     collection->size--;
 }
 
+/*
+ * Parallel materialization
+ *
+ * Converting proto-objects (nssCertificate_Create and friends) dominates
+ * listing a large collection.  nssPKIObjectCollection_MaterializeObjects
+ * converts every outstanding proto-object up front: the pending nodes are
+ * gathered, and worker threads claim them one at a time from a shared
+ * counter and create the objects uncached.  Only the decoding runs in
+ * parallel.  The calling thread then enters the results in the trust
+ * domain cache one cert at a time, taking the cache lock once per cert
+ * as cert_createObject would.  Afterwards GetCertificates, GetCRLs and
+ * Traverse find nothing left to convert.
+ */
+typedef struct
+{
+  nssPKIObjectCollection *collection;
+  pkiObjectCollectionNode **nodes;
+  nssPKIObject **objects;
+  PRUint32 numNodes;
+  PRInt32 next; /* next unclaimed index, advanced atomically */
+} materialize_args;
+
+static void
+materialize_worker(void *arg)
+{
+    materialize_args *args = arg;
+    PRInt32 i;
+    while ((i = PR_ATOMIC_INCREMENT(&args->next) - 1) < 
+           (PRInt32)args->numNodes) 
+    {
+	args->objects[i] = 
+	  (*args->collection->createUncachedObject)(args->nodes[i]->object);
+    }
+}
+
+static PRIntn
+count_pending_callback(PLHashEntry *he, PRIntn index, void *arg)
+{
+    pkiObjectCollectionNode *node = he->value;
+    if (!node->haveObject) {
+	(*(PRUint32 *)arg)++;
+    }
+    return HT_ENUMERATE_NEXT;
+}
+
+static PRIntn
+collect_pending_callback(PLHashEntry *he, PRIntn index, void *arg)
+{
+    materialize_args *args = arg;
+    pkiObjectCollectionNode *node = he->value;
+    if (!node->haveObject) {
+	args->nodes[args->numNodes++] = node;
+    }
+    return HT_ENUMERATE_NEXT;
+}
+
+#define PKI_MAX_MATERIALIZE_THREADS 64
+
+NSS_IMPLEMENT PRStatus
+nssPKIObjectCollection_MaterializeObjects (
+  nssPKIObjectCollection *collection,
+  PRUint32 numThreads
+)
+{
+    materialize_args args;
+    PRThread *threads[PKI_MAX_MATERIALIZE_THREADS];
+    PRUint32 i, numCreated, numPending = 0, numStarted = 0;
+    PRStatus status = PR_SUCCESS;
+
+    /* count first, so that a collection with nothing left to convert
+     * costs no allocation
+     */
+    PL_HashTableEnumerateEntries(collection->PKIobjecthashtable,
+                                 count_pending_callback, &numPending);
+    if (numPending == 0) {
+	return PR_SUCCESS;
+    }
+    args.collection = collection;
+    args.numNodes = 0;
+    args.next = 0;
+    args.nodes = nss_ZNEWARRAY(NULL, pkiObjectCollectionNode *, numPending);
+    args.objects = nss_ZNEWARRAY(NULL, nssPKIObject *, numPending);
+    if (!args.nodes || !args.objects) {
+	status = PR_FAILURE;
+	goto done;
+    }
+    PL_HashTableEnumerateEntries(collection->PKIobjecthashtable,
+                                 collect_pending_callback, &args);
+    numThreads = PR_MIN(numThreads, PKI_MAX_MATERIALIZE_THREADS);
+    numThreads = PR_MIN(numThreads, args.numNodes);
+    /* the calling thread is one of the workers */
+    for (i=1; i<numThreads; i++) {
+	threads[numStarted] = PR_CreateThread(PR_USER_THREAD, 
+	                                      materialize_worker, &args,
+	                                      PR_PRIORITY_NORMAL, 
+	                                      PR_GLOBAL_THREAD,
+	                                      PR_JOINABLE_THREAD, 0);
+	if (!threads[numStarted]) {
+	    break; /* carry on with the threads we have */
+	}
+	numStarted++;
+    }
+    materialize_worker(&args);
+    for (i=0; i<numStarted; i++) {
+	PR_JoinThread(threads[i]);
+    }
+    /* Drop the failures, leaving those nodes as proto-objects, and enter
+     * the rest in the cache.
+     */
+    numCreated = 0;
+    for (i=0; i<args.numNodes; i++) {
+	if (args.objects[i]) {
+	    args.nodes[numCreated] = args.nodes[i];
+	    args.objects[numCreated++] = args.objects[i];
+	} else {
+	    status = PR_FAILURE;
+	}
+    }
+    if (numCreated > 0 && collection->cacheObjects) {
+	(*collection->cacheObjects)(collection->td, args.objects, numCreated);
+    }
+    for (i=0; i<numCreated; i++) {
+	args.nodes[i]->object = args.objects[i];
+	args.nodes[i]->haveObject = PR_TRUE;
+    }
+done:
+    nss_ZFreeIf(args.nodes);
+    nss_ZFreeIf(args.objects);
+    return status;
+}
+
 PRIntn get_objects_callback(PLHashEntry *he, PRIntn index,void *_args)
 {
   struct get_obj_args *args = _args;
@@ -978,6 +2243,93 @@ nssPKIObjectCollection_Traverse (
     return PR_SUCCESS;
 }
 
+/* nssPKIObjectCollectionIterator
+ *
+ * Walks a collection one object at a time, converting proto-objects into
+ * real objects only as they are reached, so a caller that stops early
+ * does not pay for decoding the rest of the collection.  Adding to the
+ * collection while an iterator is live may rehash the tables and is not
+ * allowed.
+ */
+struct nssPKIObjectCollectionIteratorStr
+{
+  nssPKIObjectCollection *collection;
+  PRUint32 bucket;    /* next bucket to scan */
+  PLHashEntry *entry; /* next entry in the current chain */
+};
+
+NSS_IMPLEMENT nssPKIObjectCollectionIterator *
+nssPKIObjectCollection_CreateIterator (
+  nssPKIObjectCollection *collection
+)
+{
+    nssPKIObjectCollectionIterator *iter;
+    iter = nss_ZNEW(NULL, nssPKIObjectCollectionIterator);
+    if (iter) {
+	iter->collection = collection;
+    }
+    return iter;
+}
+
+NSS_IMPLEMENT void
+nssPKIObjectCollectionIterator_Destroy (
+  nssPKIObjectCollectionIterator *iter
+)
+{
+    nss_ZFreeIf(iter);
+}
+
+/* Returns the next object with a reference added, or NULL at the end.
+ * Nodes whose proto-object cannot be converted are skipped.
+ */
+static nssPKIObject *
+iterator_next_object (
+  nssPKIObjectCollectionIterator *iter
+)
+{
+    PLHashTable *ht = iter->collection->PKIobjecthashtable;
+    PRUint32 nbuckets = 1U << (PL_HASH_BITS - ht->shift);
+    for (;;) {
+	pkiObjectCollectionNode *node;
+	nssPKIObject *object;
+	while (!iter->entry) {
+	    if (iter->bucket >= nbuckets) {
+		return (nssPKIObject *)NULL;
+	    }
+	    iter->entry = ht->buckets[iter->bucket++];
+	}
+	node = iter->entry->value;
+	iter->entry = iter->entry->next;
+	if (!node->haveObject) {
+	    object = (*iter->collection->createObject)(node->object);
+	    if (!object) {
+		continue;
+	    }
+	    node->object = object;
+	    node->haveObject = PR_TRUE;
+	}
+	return nssPKIObject_AddRef(node->object);
+    }
+}
+
+NSS_IMPLEMENT NSSCertificate *
+nssPKIObjectCollectionIterator_NextCertificate (
+  nssPKIObjectCollectionIterator *iter
+)
+{
+    PR_ASSERT(iter->collection->objectType == pkiObjectType_Certificate);
+    return (NSSCertificate *)iterator_next_object(iter);
+}
+
+NSS_IMPLEMENT NSSCRL *
+nssPKIObjectCollectionIterator_NextCRL (
+  nssPKIObjectCollectionIterator *iter
+)
+{
+    PR_ASSERT(iter->collection->objectType == pkiObjectType_CRL);
+    return (NSSCRL *)iterator_next_object(iter);
+}
+
 NSS_IMPLEMENT PRStatus
 nssPKIObjectCollection_AddInstanceAsObject (
   nssPKIObjectCollection *collection,
@@ -985,29 +2337,58 @@ nssPKIObjectCollection_AddInstanceAsObject (
 )
 {
     pkiObjectCollectionNode *node;
+    nssPKIObject *object;
     PRBool foundIt;
     node = add_object_instance(collection, instance, &foundIt);
     if (node == NULL) {
 	return PR_FAILURE;
     }
+    /* In a concurrent collection, claim the node under the lock and
+     * convert it with the lock released, since createObject goes to the
+     * token, decodes and takes the trust domain cache lock.  Other
+     * threads wait for the conversion before touching the node (see
+     * add_instance_to_node).
+     */
+    COLLECTION_LOCK(collection);
+    while (node->converting) {
+	PZ_WaitCondVar(collection->converted, PR_INTERVAL_NO_TIMEOUT);
+    }
+    if (!node->object) {
+	/* an earlier conversion of this node failed */
+	COLLECTION_UNLOCK(collection);
+	return PR_FAILURE;
+    }
     if (!node->haveObject) {
-	node->object = (*collection->createObject)(node->object);
-	if (!node->object) {
+	node->converting = PR_TRUE;
+	COLLECTION_UNLOCK(collection);
+	object = (*collection->createObject)(node->object);
+	COLLECTION_LOCK(collection);
+	node->converting = PR_FALSE;
+	node->object = object;
+	if (object) {
+	    node->haveObject = PR_TRUE;
+	} else {
 	    /*remove bogus object from list*/
 	    nssPKIObjectCollection_RemoveNode(collection,node);
-	    return PR_FAILURE;
 	}
-	node->haveObject = PR_TRUE;
-    } else if (!foundIt) {
-	/* The instance was added to a pre-existing node.  This
-	 * function is *only* being used for certificates, and having
-	 * multiple instances of certs in 3.X requires updating the
-	 * CERTCertificate.
-	 * But only do it if it was a new instance!!!  If the same instance
-	 * is encountered, we set *foundIt to true.  Detect that here and
-	 * ignore it.
-	 */
-	STAN_ForceCERTCertificateUpdate((NSSCertificate *)node->object);
+	if (collection->converted) {
+	    PZ_NotifyAllCondVar(collection->converted);
+	}
+	COLLECTION_UNLOCK(collection);
+	return (object ? PR_SUCCESS : PR_FAILURE);
+    } else {
+	COLLECTION_UNLOCK(collection);
+	if (!foundIt) {
+	    /* The instance was added to a pre-existing node.  This
+	     * function is *only* being used for certificates, and having
+	     * multiple instances of certs in 3.X requires updating the
+	     * CERTCertificate.
+	     * But only do it if it was a new instance!!!  If the same instance
+	     * is encountered, we set *foundIt to true.  Detect that here and
+	     * ignore it.
+	     */
+	    STAN_ForceCERTCertificateUpdate((NSSCertificate *)node->object);
+	}
     }
     return PR_SUCCESS;
 }
@@ -1031,7 +2412,7 @@ cert_destroyObject(nssPKIObject *o)
 }
 
 static PRStatus
-cert_getUIDFromObject(nssPKIObject *o, NSSItem *uid)
+cert_getUIDFromObject(nssPKIObject *o, NSSItem *uid, NSSArena *arena)
 {
     NSSCertificate *c = (NSSCertificate *)o;
     /* The builtins are still returning decoded serial numbers.  Until
@@ -1068,8 +2449,68 @@ cert_getUIDFromInstance(nssCryptokiObject *instance, NSSItem *uid,
                                                 NULL);  /* subject  */
 }
 
+/* Digest uids
+ *
+ * Optionally, an object is identified by the SHA-256 of its encoding
+ * rather than the encoding itself.  Nodes then hold 32 bytes instead of
+ * the full DER, and compare_objects is a single fixed-size memcmp.  The
+ * encoding fetched from the token is hashed and freed immediately, so it
+ * is never copied into the collection arena.
+ */
+static PRStatus
+digest_uid(NSSItem *encoding, NSSItem *uid, NSSArena *arena)
+{
+    uid[1].data = NULL; uid[1].size = 0;
+    uid[0].data = nss_ZAlloc(arena, SHA256_LENGTH);
+    if (!uid[0].data) {
+	return PR_FAILURE;
+    }
+    uid[0].size = SHA256_LENGTH;
+    if (HASH_HashBuf(HASH_AlgSHA256, uid[0].data, 
+                     encoding->data, encoding->size) != SECSuccess) {
+	nss_SetError(NSS_ERROR_INTERNAL_ERROR);
+	return PR_FAILURE;
+    }
+    return PR_SUCCESS;
+}
+
+static PRStatus
+cert_getDigestUIDFromObject(nssPKIObject *o, NSSItem *uid, NSSArena *arena)
+{
+    NSSDER *derCert;
+    derCert = nssCertificate_GetEncoding((NSSCertificate *)o);
+    if (!derCert) {
+	nss_SetError(NSS_ERROR_INVALID_ARGUMENT);
+	return PR_FAILURE;
+    }
+    return digest_uid(derCert, uid, arena);
+}
+
+static PRStatus
+cert_getDigestUIDFromInstance(nssCryptokiObject *instance, NSSItem *uid, 
+                              NSSArena *arena)
+{
+    NSSDER encoding;
+    PRStatus status;
+    encoding.data = NULL; encoding.size = 0;
+    status = nssCryptokiCertificate_GetAttributes(instance,
+                                                  NULL,  /* XXX sessionOpt */
+                                                  NULL,  /* arena    */
+                                                  NULL,  /* type     */
+                                                  NULL,  /* id       */
+                                                  &encoding, /* encoding */
+                                                  NULL,  /* issuer   */
+                                                  NULL,  /* serial   */
+                                                  NULL);  /* subject  */
+    if (status == PR_SUCCESS) {
+	status = digest_uid(&encoding, uid, arena);
+    }
+    nss_ZFreeIf(encoding.data);
+    return status;
+}
+
 static nssPKIObject *
-cert_createObject(nssPKIObject *o)
+cert_createUncachedObject(nssPKIObject *o)
 {
     NSSCertificate *cert;
     cert = nssCertificate_Create(o);
@@ -1077,25 +2518,53 @@ cert_createObject(nssPKIObject *o)
 	nssCertificate_Destroy(cert);
 	return (nssPKIObject *)NULL;
     } */
+    return (nssPKIObject *)cert;
+}
+
+static void
+cert_cacheObjects(NSSTrustDomain *td, nssPKIObject **objects, 
+                  PRUint32 numObjects)
+{
+    PRUint32 i;
     /* In 3.4, have to maintain uniqueness of cert pointers by caching all
-     * certs.  Cache the cert here, before returning.  If it is already
-     * cached, take the cached entry.
+     * certs.  If a cert is already cached, take the cached entry.
+     * nssTrustDomain_AddCertsToCache stops at the first cert it fails to
+     * add, so add them one at a time: as in cert_createObject, a cert
+     * that cannot be cached is used uncached, and the rest still are.
      */
-    {
-	NSSTrustDomain *td = o->trustDomain;
-	nssTrustDomain_AddCertsToCache(td, &cert, 1);
+    for (i=0; i<numObjects; i++) {
+	(void)nssTrustDomain_AddCertsToCache(td, 
+	                                     (NSSCertificate **)&objects[i], 1);
     }
-    return (nssPKIObject *)cert;
 }
 
+static nssPKIObject *
+cert_createObject(nssPKIObject *o)
+{
+    nssPKIObject *cert;
+    cert = cert_createUncachedObject(o);
+    /* Cache the cert here, before returning. */
+    if (cert) {
+	cert_cacheObjects(o->trustDomain, &cert, 1);
+    }
+    return cert;
+}
+
+/* Create a collection with its hash tables presized for sizeHint
+ * objects.  If sizeHint is 0 and certsOpt is given, the array length is used.
+ */
 NSS_IMPLEMENT nssPKIObjectCollection *
-nssCertificateCollection_Create (
+nssCertificateCollection_CreateWithSize (
   NSSTrustDomain *td,
-  NSSCertificate **certsOpt
+  NSSCertificate **certsOpt,
+  PRUint32 sizeHint
 )
 {
     nssPKIObjectCollection *collection;
-    collection = nssPKIObjectCollection_Create(td, NULL, nssPKIMonitor);
+    if (sizeHint == 0 && certsOpt) {
+	while (certsOpt[sizeHint]) sizeHint++;
+    }
+    collection = nssPKIObjectCollection_Create(td, NULL, nssPKIMonitor, sizeHint);
     if (!collection) {
         return NULL;
     }
@@ -1104,6 +2573,8 @@ nssCertificateCollection_Create (
     collection->getUIDFromObject = cert_getUIDFromObject;
     collection->getUIDFromInstance = cert_getUIDFromInstance;
     collection->createObject = cert_createObject;
+    collection->createUncachedObject = cert_createUncachedObject;
+    collection->cacheObjects = cert_cacheObjects;
     if (certsOpt) {
 	for (; *certsOpt; certsOpt++) {
 	    nssPKIObject *object = (nssPKIObject *)(*certsOpt);
@@ -1113,6 +2584,15 @@ nssCertificateCollection_Create (
     return collection;
 }
 
+NSS_IMPLEMENT nssPKIObjectCollection *
+nssCertificateCollection_Create (
+  NSSTrustDomain *td,
+  NSSCertificate **certsOpt
+)
+{
+    return nssCertificateCollection_CreateWithSize(td, certsOpt, 0);
+}
+
 NSS_IMPLEMENT NSSCertificate **
 nssPKIObjectCollection_GetCertificates (
   nssPKIObjectCollection *collection,
@@ -1163,7 +2643,7 @@ crl_destroyObject(nssPKIObject *o)
 }
 
 static PRStatus
-crl_getUIDFromObject(nssPKIObject *o, NSSItem *uid)
+crl_getUIDFromObject(nssPKIObject *o, NSSItem *uid, NSSArena *arena)
 {
     NSSCRL *crl = (NSSCRL *)o;
     NSSDER *encoding;
@@ -1191,20 +2671,64 @@ crl_getUIDFromInstance(nssCryptokiObject *instance, NSSItem *uid,
                                         NULL);   /* isKRL    */
 }
 
+/* digest uids for CRLs (see digest_uid); CRLs can run to tens of
+ * megabytes, so this keeps their bodies out of the collection arena
+ */
+static PRStatus
+crl_getDigestUIDFromObject(nssPKIObject *o, NSSItem *uid, NSSArena *arena)
+{
+    NSSDER *encoding;
+    encoding = nssCRL_GetEncoding((NSSCRL *)o);
+    if (!encoding) {
+	nss_SetError(NSS_ERROR_INVALID_ARGUMENT);
+	return PR_FAILURE;
+    }
+    return digest_uid(encoding, uid, arena);
+}
+
+static PRStatus
+crl_getDigestUIDFromInstance(nssCryptokiObject *instance, NSSItem *uid, 
+                             NSSArena *arena)
+{
+    NSSDER encoding;
+    PRStatus status;
+    encoding.data = NULL; encoding.size = 0;
+    status = nssCryptokiCRL_GetAttributes(instance,
+                                          NULL,      /* XXX sessionOpt */
+                                          NULL,      /* arena    */
+                                          &encoding, /* encoding */
+                                          NULL,      /* subject  */
+                                          NULL,      /* class    */
+                                          NULL,      /* url      */
+                                          NULL);     /* isKRL    */
+    if (status == PR_SUCCESS) {
+	status = digest_uid(&encoding, uid, arena);
+    }
+    nss_ZFreeIf(encoding.data);
+    return status;
+}
+
 static nssPKIObject *
 crl_createObject(nssPKIObject *o)
 {
     return (nssPKIObject *)nssCRL_Create(o);
 }
 
+/* Create a collection with its hash tables presized for sizeHint
+ * objects.  If sizeHint is 0 and crlsOpt is given, the array length is used.
+ */
 NSS_IMPLEMENT nssPKIObjectCollection *
-nssCRLCollection_Create (
+nssCRLCollection_CreateWithSize (
   NSSTrustDomain *td,
-  NSSCRL **crlsOpt
+  NSSCRL **crlsOpt,
+  PRUint32 sizeHint
 )
 {
     nssPKIObjectCollection *collection;
-    collection = nssPKIObjectCollection_Create(td, NULL, nssPKILock);
+    if (sizeHint == 0 && crlsOpt) {
+	while (crlsOpt[sizeHint]) sizeHint++;
+    }
+    collection = nssPKIObjectCollection_Create(td, NULL, nssPKILock, sizeHint);
     if (!collection) {
         return NULL;
     }
@@ -1213,6 +2737,8 @@ nssCRLCollection_Create (
     collection->getUIDFromObject = crl_getUIDFromObject;
     collection->getUIDFromInstance = crl_getUIDFromInstance;
     collection->createObject = crl_createObject;
+    collection->createUncachedObject = crl_createObject;
+    collection->cacheObjects = NULL;
     if (crlsOpt) {
 	for (; *crlsOpt; crlsOpt++) {
 	    nssPKIObject *object = (nssPKIObject *)(*crlsOpt);
@@ -1222,6 +2748,15 @@ nssCRLCollection_Create (
     return collection;
 }
 
+NSS_IMPLEMENT nssPKIObjectCollection *
+nssCRLCollection_Create (
+  NSSTrustDomain *td,
+  NSSCRL **crlsOpt
+)
+{
+    return nssCRLCollection_CreateWithSize(td, crlsOpt, 0);
+}
+
 NSS_IMPLEMENT NSSCRL **
 nssPKIObjectCollection_GetCRLs (
   nssPKIObjectCollection *collection,
@@ -1260,15 +2795,342 @@ nssPKIObjectCollection_GetCRLs (
     return rvOpt;
 }
 
-/* how bad would it be to have a static now sitting around, updated whenever
- * this was called?  would avoid repeated allocs...
+/* Switch the collection to digest uids (see digest_uid).  This must be
+ * done before anything is added, since existing nodes would be keyed
+ * differently.
+ */
+NSS_IMPLEMENT PRStatus
+nssPKIObjectCollection_UseDigestUIDs (
+  nssPKIObjectCollection *collection
+)
+{
+    if (collection->size > 0) {
+	nss_SetError(NSS_ERROR_INVALID_ARGUMENT);
+	return PR_FAILURE;
+    }
+    switch (collection->objectType) {
+    case pkiObjectType_Certificate:
+	collection->getUIDFromObject = cert_getDigestUIDFromObject;
+	collection->getUIDFromInstance = cert_getDigestUIDFromInstance;
+	return PR_SUCCESS;
+    case pkiObjectType_CRL:
+	collection->getUIDFromObject = crl_getDigestUIDFromObject;
+	collection->getUIDFromInstance = crl_getDigestUIDFromInstance;
+	return PR_SUCCESS;
+    default:
+	nss_SetError(NSS_ERROR_INVALID_ARGUMENT);
+	return PR_FAILURE;
+    }
+}
+
+/*
+ * Private and public key collections
+ */
+
+/* Fetch the key uid (see the uid sets above) with a single
+ * C_GetAttributeValue.  Attributes the key does not have come back empty:
+ * EC keys have no modulus, and EC private keys no EC point either.  Such
+ * a key has nothing that identifies it across tokens (CKA_ID will not
+ * do; many smartcards give every key the same one), so its uid is the
+ * token and handle, and it is never merged with a key on another token.
+ * With a NULL arena the uid is in the heap, like the other uid fetches,
+ * and the attributes not used for it are freed.
+ */
+static PRStatus
+key_getUIDFromInstance(nssCryptokiObject *instance, NSSItem *uid, 
+                       NSSArena *arena)
+{
+    CK_ATTRIBUTE keyTemplate[3];
+    NSSItem modulus, exponent, point;
+    nssSession *session;
+    NSSSlot *slot;
+    PRStatus status;
+
+    nsslibc_memset(keyTemplate, 0, sizeof keyTemplate);
+    keyTemplate[0].type = CKA_MODULUS;
+    keyTemplate[1].type = CKA_PUBLIC_EXPONENT;
+    keyTemplate[2].type = CKA_EC_POINT;
+    session = nssToken_GetDefaultSession(instance->token);
+    slot = nssToken_GetSlot(instance->token);
+    if (!session || !slot) {
+	if (slot) {
+	    nssSlot_Destroy(slot);
+	}
+	nss_SetError(NSS_ERROR_INVALID_ARGUMENT);
+	return PR_FAILURE;
+    }
+    status = nssCKObject_GetAttributes(instance->handle, keyTemplate, 3,
+                                       arena, session, slot);
+    nssSlot_Destroy(slot);
+    if (status != PR_SUCCESS) {
+	return status;
+    }
+    NSS_CK_ATTRIBUTE_TO_ITEM(&keyTemplate[0], &modulus);
+    NSS_CK_ATTRIBUTE_TO_ITEM(&keyTemplate[1], &exponent);
+    NSS_CK_ATTRIBUTE_TO_ITEM(&keyTemplate[2], &point);
+    uid[1].data = NULL; uid[1].size = 0;
+    if (modulus.size > 0) {
+	uid[0] = modulus;
+	uid[1] = exponent;
+	if (!arena) {
+	    nss_ZFreeIf(point.data);
+	}
+	return PR_SUCCESS;
+    }
+    if (!arena) {
+	nss_ZFreeIf(modulus.data);
+	nss_ZFreeIf(exponent.data);
+    }
+    if (point.size > 0) {
+	uid[0] = point;
+	return PR_SUCCESS;
+    }
+    if (!arena) {
+	nss_ZFreeIf(point.data);
+    }
+    uid[0].size = sizeof instance->token;
+    uid[0].data = nss_ZAlloc(arena, uid[0].size);
+    uid[1].size = sizeof instance->handle;
+    uid[1].data = nss_ZAlloc(arena, uid[1].size);
+    if (!uid[0].data || !uid[1].data) {
+	if (!arena) {
+	    nss_ZFreeIf(uid[0].data);
+	    nss_ZFreeIf(uid[1].data);
+	}
+	uid[0].data = uid[1].data = NULL;
+	uid[0].size = uid[1].size = 0;
+	return PR_FAILURE;
+    }
+    nsslibc_memcpy(uid[0].data, &instance->token, uid[0].size);
+    nsslibc_memcpy(uid[1].data, &instance->handle, uid[1].size);
+    return PR_SUCCESS;
+}
+
+/* Key objects carry no decoded key material, so the uid is read from
+ * one of their token instances.
  */
+static PRStatus
+key_getUIDFromObject(nssPKIObject *o, NSSItem *uid, NSSArena *arena)
+{
+    nssCryptokiObject **instances;
+    PRStatus status = PR_FAILURE;
+    instances = nssPKIObject_GetInstances(o);
+    if (instances && instances[0]) {
+	status = key_getUIDFromInstance(instances[0], uid, arena);
+    } else {
+	nss_SetError(NSS_ERROR_INVALID_ARGUMENT);
+    }
+    nssCryptokiObjectArray_Destroy(instances);
+    return status;
+}
+
+static void
+pvk_destroyObject(nssPKIObject *o)
+{
+    (void)nssPrivateKey_Destroy((NSSPrivateKey *)o);
+}
+
+static nssPKIObject *
+pvk_createObject(nssPKIObject *o)
+{
+    return (nssPKIObject *)nssPrivateKey_Create(o);
+}
+
+NSS_IMPLEMENT nssPKIObjectCollection *
+nssPrivateKeyCollection_Create (
+  NSSTrustDomain *td,
+  NSSPrivateKey **pvkOpt
+)
+{
+    nssPKIObjectCollection *collection;
+    collection = nssPKIObjectCollection_Create(td, NULL, nssPKILock, 0);
+    if (!collection) {
+        return NULL;
+    }
+    collection->objectType = pkiObjectType_PrivateKey;
+    collection->destroyObject = pvk_destroyObject;
+    collection->getUIDFromObject = key_getUIDFromObject;
+    collection->getUIDFromInstance = key_getUIDFromInstance;
+    collection->createObject = pvk_createObject;
+    collection->createUncachedObject = pvk_createObject;
+    collection->cacheObjects = NULL;
+    if (pvkOpt) {
+	for (; *pvkOpt; pvkOpt++) {
+	    nssPKIObject *object = (nssPKIObject *)(*pvkOpt);
+	    (void)nssPKIObjectCollection_AddObject(collection, object);
+	}
+    }
+    return collection;
+}
+
+NSS_IMPLEMENT NSSPrivateKey **
+nssPKIObjectCollection_GetPrivateKeys (
+  nssPKIObjectCollection *collection,
+  NSSPrivateKey **rvOpt,
+  PRUint32 maximumOpt,
+  NSSArena *arenaOpt
+)
+{
+    PRStatus status;
+    PRUint32 rvSize;
+    PRBool allocated = PR_FALSE;
+    if (collection->size == 0) {
+	return (NSSPrivateKey **)NULL;
+    }
+    if (maximumOpt == 0) {
+	rvSize = collection->size;
+    } else {
+	rvSize = PR_MIN(collection->size, maximumOpt);
+    }
+    if (!rvOpt) {
+	rvOpt = nss_ZNEWARRAY(arenaOpt, NSSPrivateKey *, rvSize + 1);
+	if (!rvOpt) {
+	    return (NSSPrivateKey **)NULL;
+	}
+	allocated = PR_TRUE;
+    }
+    status = nssPKIObjectCollection_GetObjects(collection, 
+                                               (nssPKIObject **)rvOpt, 
+                                               rvSize);
+    if (status != PR_SUCCESS) {
+	if (allocated) {
+	    nss_ZFreeIf(rvOpt);
+	}
+	return (NSSPrivateKey **)NULL;
+    }
+    return rvOpt;
+}
+
+static void
+pbk_destroyObject(nssPKIObject *o)
+{
+    (void)nssPublicKey_Destroy((NSSPublicKey *)o);
+}
+
+static nssPKIObject *
+pbk_createObject(nssPKIObject *o)
+{
+    return (nssPKIObject *)nssPublicKey_Create(o);
+}
+
+NSS_IMPLEMENT nssPKIObjectCollection *
+nssPublicKeyCollection_Create (
+  NSSTrustDomain *td,
+  NSSPublicKey **pbkOpt
+)
+{
+    nssPKIObjectCollection *collection;
+    collection = nssPKIObjectCollection_Create(td, NULL, nssPKILock, 0);
+    if (!collection) {
+        return NULL;
+    }
+    collection->objectType = pkiObjectType_PublicKey;
+    collection->destroyObject = pbk_destroyObject;
+    collection->getUIDFromObject = key_getUIDFromObject;
+    collection->getUIDFromInstance = key_getUIDFromInstance;
+    collection->createObject = pbk_createObject;
+    collection->createUncachedObject = pbk_createObject;
+    collection->cacheObjects = NULL;
+    if (pbkOpt) {
+	for (; *pbkOpt; pbkOpt++) {
+	    nssPKIObject *object = (nssPKIObject *)(*pbkOpt);
+	    (void)nssPKIObjectCollection_AddObject(collection, object);
+	}
+    }
+    return collection;
+}
+
+NSS_IMPLEMENT NSSPublicKey **
+nssPKIObjectCollection_GetPublicKeys (
+  nssPKIObjectCollection *collection,
+  NSSPublicKey **rvOpt,
+  PRUint32 maximumOpt,
+  NSSArena *arenaOpt
+)
+{
+    PRStatus status;
+    PRUint32 rvSize;
+    PRBool allocated = PR_FALSE;
+    if (collection->size == 0) {
+	return (NSSPublicKey **)NULL;
+    }
+    if (maximumOpt == 0) {
+	rvSize = collection->size;
+    } else {
+	rvSize = PR_MIN(collection->size, maximumOpt);
+    }
+    if (!rvOpt) {
+	rvOpt = nss_ZNEWARRAY(arenaOpt, NSSPublicKey *, rvSize + 1);
+	if (!rvOpt) {
+	    return (NSSPublicKey **)NULL;
+	}
+	allocated = PR_TRUE;
+    }
+    status = nssPKIObjectCollection_GetObjects(collection, 
+                                               (nssPKIObject **)rvOpt, 
+                                               rvSize);
+    if (status != PR_SUCCESS) {
+	if (allocated) {
+	    nss_ZFreeIf(rvOpt);
+	}
+	return (NSSPublicKey **)NULL;
+    }
+    return rvOpt;
+}
+
+/* Coarse clock
+ *
+ * Certificate selection only needs the time to within a few milliseconds.
+ * Where the platform has CLOCK_REALTIME_COARSE, NSSTime_SetCoarseResolution
+ * lets the caller accept that much staleness in exchange for a clock read
+ * that is a plain load from the vDSO page.  The coarse clock is used only
+ * if its granularity is within the requested resolution.
+ */
+static PRBool nssTimeUseCoarseClock = PR_FALSE;
+
+/* resolution is in microseconds; 0 turns the coarse clock off */
+NSS_IMPLEMENT PRStatus
+NSSTime_SetCoarseResolution (
+  PRTime resolution
+)
+{
+#ifdef CLOCK_REALTIME_COARSE
+    struct timespec res;
+    if (resolution > 0 && clock_getres(CLOCK_REALTIME_COARSE, &res) == 0 &&
+        (PRTime)res.tv_sec * PR_USEC_PER_SEC + res.tv_nsec / 1000 <= 
+            resolution) 
+    {
+	nssTimeUseCoarseClock = PR_TRUE;
+	return PR_SUCCESS;
+    }
+#endif
+    nssTimeUseCoarseClock = PR_FALSE;
+    return (resolution > 0) ? PR_FAILURE : PR_SUCCESS;
+}
+
+/* The current time, without allocating. */
+NSS_IMPLEMENT PRTime
+nssTime_NowPRTime (
+  void
+)
+{
+#ifdef CLOCK_REALTIME_COARSE
+    if (nssTimeUseCoarseClock) {
+	struct timespec ts;
+	if (clock_gettime(CLOCK_REALTIME_COARSE, &ts) == 0) {
+	    return (PRTime)ts.tv_sec * PR_USEC_PER_SEC + ts.tv_nsec / 1000;
+	}
+    }
+#endif
+    return PR_Now();
+}
+
 NSS_IMPLEMENT NSSTime *
 NSSTime_Now (
   NSSTime *timeOpt
 )
 {
-    return NSSTime_SetPRTime(timeOpt, PR_Now());
+    return NSSTime_SetPRTime(timeOpt, nssTime_NowPRTime());
 }
 
 NSS_IMPLEMENT NSSTime *